@@ -10,116 +10,889 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
-#include "i2c-dev.h"
+#include "fpga.h"
+#include "fpga_sim.h"
 
-static uint8_t i2c_addr;
+/* FPGA context
+ *
+ * Each context is one FPGA at one address on one bus, with its own transport
+ * instance. Any number of contexts can be open at once. All bus access from a
+ * context is serialized by its lock, so a context may be shared between
+ * threads. A single peek, poke, or committed fpga_xfer transaction is always
+ * issued to the bus as one uninterrupted unit.
+ */
+struct fpga_ctx {
+	const struct fpga_transport *transport;
+	void *priv;
+	uint8_t i2c_addr;
+	int nostart;
+	size_t chunk;
+	struct fpga_cache *cache;
+	struct fpga_stats *stats;
+	pthread_mutex_t lock;
+};
 
-int fpga_init(const char *i2c_bus, uint8_t addr)
+/* Transports
+ *
+ * All bus traffic goes through a transport, which takes a list of I2C
+ * messages formatted exactly as they would be for the I2C_RDWR ioctl. The
+ * default transport is the Linux i2c-dev interface. Alternate transports are
+ * selected by name, either by passing the name as the bus to fpga_init(), or
+ * by setting the FPGA_BUS environment variable which overrides the bus that
+ * the application requested. Anything after a ':' in the name is passed to
+ * the transport as options, e.g. "sim:latency=100".
+ */
+static int i2c_open(void **priv, const char *i2c_bus, uint8_t addr)
 {
-	static int fd = -1;
-
-	i2c_addr = addr;
-
-	if(fd != -1)
-		return fd;
+	int fd;
 
 	fd = open(i2c_bus, O_RDWR);
 	if(fd != -1) {
-		if (ioctl(fd, I2C_SLAVE_FORCE, i2c_addr) < 0) {
+		if (ioctl(fd, I2C_SLAVE_FORCE, addr) < 0) {
 			perror("FPGA did not ACK request\n");
+			close(fd);
 			return -1;
 		}
 	}
 
+	*priv = (void *)(intptr_t)fd;
 	return fd;
 }
 
-int fpga_deinit(int twifd)
+static int i2c_xfer(void *priv, struct i2c_msg *msgs, int nmsgs)
 {
-	return close(twifd);
+	struct i2c_rdwr_ioctl_data packets;
+
+	packets.msgs = msgs;
+	packets.nmsgs = nmsgs;
+
+	return ioctl((intptr_t)priv, I2C_RDWR, &packets);
 }
 
-int fpeekstream8(int twifd, uint8_t *data, uint16_t addr, int size)
+static unsigned long i2c_funcs(void *priv)
 {
-	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msgs[2];
-	char busaddr[2];
+	unsigned long funcs = 0;
 
-	/* Linux only supports 4k transactions at a time, and we need
-	 * two bytes for the address */
-	assert(size <= 4094);
+	if (ioctl((intptr_t)priv, I2C_FUNCS, &funcs) < 0) return 0;
 
-	busaddr[0]    = ((addr >> 8) & 0xff);
-	busaddr[1]    = (addr & 0xff);
+	return funcs;
+}
 
-	msgs[0].addr  = i2c_addr;
-	msgs[0].flags = 0;
-	msgs[0].len   = 2;
-	msgs[0].buf   = busaddr;
+static int i2c_close(void *priv)
+{
+	return close((intptr_t)priv);
+}
 
-	msgs[1].addr  = i2c_addr;
-	msgs[1].flags = I2C_M_RD;
-	msgs[1].len   = size;
-	msgs[1].buf   = (char *)data;
+static const struct fpga_transport fpga_i2c_transport = {
+	.name = "i2c-dev",
+	/* Linux only supports 4k transactions at a time */
+	.max_len = 4096,
+	.open = i2c_open,
+	.xfer = i2c_xfer,
+	.funcs = i2c_funcs,
+	.close = i2c_close,
+};
 
-	packets.msgs = msgs;
-	packets.nmsgs = 2;
+static const struct fpga_transport *transports[] = {
+	&fpga_sim_transport,
+	NULL,
+};
+
+/* Returns the transport whose name matches the start of bus, and sets opts
+ * to any options following the name. Falls back to i2c-dev, with bus being
+ * the path to the device node.
+ *
+ * Not intended to be called directly
+ */
+static const struct fpga_transport *fpga_transport_lookup(const char *bus,
+  const char **opts)
+{
+	const struct fpga_transport **t;
+	size_t len;
+
+	for (t = transports; *t != NULL; t++) {
+		len = strlen((*t)->name);
+		if (!strncmp(bus, (*t)->name, len) &&
+		  (bus[len] == '\0' || bus[len] == ':')) {
+			*opts = bus[len] ? &bus[len + 1] : NULL;
+			return *t;
+		}
+	}
+
+	*opts = bus;
+	return &fpga_i2c_transport;
+}
+
+/* Returns 1 if the FPGA_BUS environment selects the simulated FPGA.
+ * Applications use this to skip checks of the real hardware, such as the
+ * device-tree model.
+ */
+int fpga_simulated(void)
+{
+	const char *bus = getenv("FPGA_BUS");
+	const char *opts;
+
+	if (bus == NULL) return 0;
+
+	return fpga_transport_lookup(bus, &opts) == &fpga_sim_transport;
+}
+
+/* Register shadow cache
+ *
+ * Some FPGA registers only ever change when the host writes them, such as the
+ * ZPU reset control and the model and revision.
+ * Each address is either volatile or cacheable. Reads of cacheable addresses
+ * are served from a shadow copy once the value is known, and writes update
+ * the shadow as they are sent to the bus. Everything else always goes to the
+ * bus. The cache starts empty, and is filled by the first read or write of
+ * each cacheable address.
+ *
+ * The shadow is only correct for as long as the FPGA is only changed through
+ * this context. Any application that resets or reloads the FPGA, or shares
+ * cacheable registers with another process, must call fpga_cache_invalidate()
+ * afterwards. fpga_cache_set() changes which addresses are cacheable. The pin
+ * routing registers at 0x80-0xFF are left volatile, as tshwctl -o/-j in any
+ * other process changes them under a long lived context.
+ */
+struct fpga_cache {
+	uint32_t cacheable[0x10000 / 32];
+	uint32_t valid[0x10000 / 32];
+	uint8_t shadow[0x10000];
+};
+
+/* Addresses that are cacheable in every new context */
+static const struct {
+	uint16_t addr;
+	uint16_t len;
+} fpga_cache_defaults[] = {
+	{ 19, 1 },		/* ZPU reset/control */
+	{ 304, 5 },		/* Model, revision, sub-revision, options */
+};
+
+static inline int fpga_bit_test(const uint32_t *map, uint16_t adr)
+{
+	return !!(map[adr >> 5] & (1u << (adr & 31)));
+}
+
+static inline void fpga_bit_set(uint32_t *map, uint16_t adr, int val)
+{
+	if (val) map[adr >> 5] |= (1u << (adr & 31));
+	else map[adr >> 5] &= ~(1u << (adr & 31));
+}
+
+/* Returns 1 if every byte of len at adr is cacheable and held in the shadow
+ * Not intended to be called directly
+ */
+static int fpga_cache_hit(struct fpga_cache *cache, uint16_t adr, int len)
+{
+	for (; len > 0; len--, adr++) {
+		if (!fpga_bit_test(cache->valid, adr)) return 0;
+	}
+
+	return 1;
+}
+
+/* Copy any cacheable bytes of a write or read in to the shadow. Bytes already
+ * in the shadow are only replaced by writes; a read result is older than any
+ * write to the same address queued after it in the same transfer.
+ * Not intended to be called directly
+ */
+static void fpga_cache_fill(struct fpga_cache *cache, uint16_t adr,
+  const uint8_t *data, int len, int write)
+{
+	for (; len > 0; len--, adr++, data++) {
+		if (!fpga_bit_test(cache->cacheable, adr)) continue;
+		if (!write && fpga_bit_test(cache->valid, adr)) continue;
+		cache->shadow[adr] = *data;
+		fpga_bit_set(cache->valid, adr, 1);
+	}
+}
+
+void fpga_cache_set(struct fpga_ctx *ctx, uint16_t addr, size_t len,
+  int cacheable)
+{
+	if (ctx->cache == NULL) return;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (; len > 0; len--, addr++) {
+		fpga_bit_set(ctx->cache->cacheable, addr, cacheable);
+		fpga_bit_set(ctx->cache->valid, addr, 0);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+void fpga_cache_invalidate(struct fpga_ctx *ctx)
+{
+	if (ctx->cache == NULL) return;
+
+	pthread_mutex_lock(&ctx->lock);
+	memset(ctx->cache->valid, 0, sizeof(ctx->cache->valid));
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Open the FPGA at I2C address addr on i2c_bus.
+ *
+ * Returns a new context, or NULL with errno set if the bus could not be
+ * opened.
+ */
+struct fpga_ctx *fpga_init(const char *i2c_bus, uint8_t addr)
+{
+	struct fpga_ctx *ctx;
+	const char *bus, *opts;
+	size_t i;
+	int err;
+
+	ctx = calloc(1, sizeof(struct fpga_ctx));
+	if (ctx == NULL) return NULL;
+
+	bus = getenv("FPGA_BUS");
+	if (bus == NULL) bus = i2c_bus;
 
-	if(ioctl(twifd, I2C_RDWR, &packets) < 0) {
-		perror("Unable to read I2C data");
-		return 1;
+	ctx->i2c_addr = addr;
+	ctx->transport = fpga_transport_lookup(bus, &opts);
+	if (ctx->transport->open(&ctx->priv, opts, ctx->i2c_addr) < 0) {
+		err = errno;
+		free(ctx);
+		errno = err;
+		return NULL;
 	}
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	/* Adapters that can continue a write without a new start condition
+	 * allow pokes to be sent straight from the caller's buffer */
+	ctx->nostart = !!(ctx->transport->funcs(ctx->priv) & I2C_FUNC_NOSTART);
+	/* Data per chunk of a large transfer, writes need the address too */
+	ctx->chunk = ctx->transport->max_len - 2;
+
+	/* Runs uncached if FPGA_NOCACHE is set, or there is no memory for it */
+	if (getenv("FPGA_NOCACHE") == NULL)
+		ctx->cache = calloc(1, sizeof(struct fpga_cache));
+	for (i = 0; ctx->cache != NULL &&
+	  i < sizeof(fpga_cache_defaults) / sizeof(fpga_cache_defaults[0]); i++) {
+		fpga_cache_set(ctx, fpga_cache_defaults[i].addr,
+		  fpga_cache_defaults[i].len, 1);
+	}
+
+	return ctx;
+}
+
+int fpga_deinit(struct fpga_ctx *ctx)
+{
+	int ret;
+
+	ret = ctx->transport->close(ctx->priv);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->cache);
+	free(ctx->stats);
+	free(ctx);
+
+	return ret;
+}
+
+/* Transport IRQ
+ *
+ * On hardware the FPGA IRQ is a CPU GPIO, opened by the application. A
+ * transport with no GPIO behind it, such as the simulated FPGA, may provide
+ * the IRQ line itself.
+ */
+
+/* Returns an eventfd that is signaled on each rising edge of the FPGA IRQ, or
+ * -1 with errno set to ENOTSUP if the transport does not provide one. The fd
+ * belongs to the context and must not be closed. Read it to consume edges.
+ */
+int fpga_irq_fd(struct fpga_ctx *ctx)
+{
+	if (ctx->transport->irq_fd == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return ctx->transport->irq_fd(ctx->priv);
+}
+
+/* Returns the current level of the FPGA IRQ from the transport, or -1 with
+ * errno set to ENOTSUP if the transport does not provide one.
+ */
+int fpga_irq_level(struct fpga_ctx *ctx)
+{
+	if (ctx->transport->irq_level == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return ctx->transport->irq_level(ctx->priv);
+}
+
+/* Statistics
+ *
+ * Counting is off unless fpga_stats_enable() is called on the context. Once
+ * enabled, every transfer issued to the transport is counted and timed, and
+ * every address read or written, from the bus or the shadow cache, has its
+ * hit count incremented. The latency histogram holds the time taken by each
+ * transport transfer, bucketed by log2 of nanoseconds.
+ */
+
+/* Enable counting, or reset all counters to 0 if they were already enabled.
+ *
+ * Returns 0 on success, 1 if there is no memory for the counters.
+ */
+int fpga_stats_enable(struct fpga_ctx *ctx)
+{
+	struct fpga_stats *stats;
+
+	stats = calloc(1, sizeof(struct fpga_stats));
+	if (stats == NULL) return 1;
+
+	pthread_mutex_lock(&ctx->lock);
+	free(ctx->stats);
+	ctx->stats = stats;
+	pthread_mutex_unlock(&ctx->lock);
+
 	return 0;
 }
 
-int fpokestream8(int twifd, uint8_t *data, uint16_t addr, int size)
+/* Copy a consistent snapshot of the counters to stats.
+ *
+ * Returns 0 on success, 1 if counting is not enabled.
+ */
+int fpga_stats_get(struct fpga_ctx *ctx, struct fpga_stats *stats)
 {
-	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msg;
-	uint8_t outdata[4096];
+	int ret = 1;
 
-	/* Linux only supports 4k transactions at a time, and we need
-	 * two bytes for the address */
-	assert(size <= 4094);
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->stats != NULL) {
+		memcpy(stats, ctx->stats, sizeof(struct fpga_stats));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ctx->lock);
 
-	outdata[0] = ((addr >> 8) & 0xff);
-	outdata[1] = (addr & 0xff);
-	memcpy(&outdata[2], data, size);
+	return ret;
+}
+
+/* Print a summary of the counters, the latency histogram, and the most
+ * accessed addresses to f. Prints nothing if counting is not enabled.
+ */
+void fpga_stats_print(struct fpga_ctx *ctx, FILE *f)
+{
+	struct fpga_stats *st;
+	uint32_t last, top;
+	int i, n, adr;
+
+	st = malloc(sizeof(struct fpga_stats));
+	if (st == NULL) return;
+	if (fpga_stats_get(ctx, st)) {
+		free(st);
+		return;
+	}
+
+	fprintf(f, "fpga_ioctls=%lu\n", st->ioctls);
+	fprintf(f, "fpga_errors=%lu\n", st->errors);
+	fprintf(f, "fpga_bytes_read=%llu\n", st->rd_bytes);
+	fprintf(f, "fpga_bytes_written=%llu\n", st->wr_bytes);
+	fprintf(f, "fpga_bytes_cached=%llu\n", st->cached_bytes);
+
+	for (i = 0; i < FPGA_STATS_BUCKETS; i++) {
+		if (!st->latency[i]) continue;
+		fprintf(f, "fpga_latency_ns_%llu=%lu\n", 1ULL << i,
+		  st->latency[i]);
+	}
+
+	/* Ten busiest addresses, highest first */
+	last = UINT32_MAX;
+	for (n = 0; n < 10; ) {
+		top = 0;
+		for (adr = 0; adr < 0x10000; adr++) {
+			if (st->hits[adr] > top && st->hits[adr] < last)
+				top = st->hits[adr];
+		}
+		if (!top) break;
+		for (adr = 0; adr < 0x10000 && n < 10; adr++) {
+			if (st->hits[adr] != top) continue;
+			fprintf(f, "fpga_hits_0x%04X=%u\n", adr, top);
+			n++;
+		}
+		last = top;
+	}
+
+	free(st);
+}
+
+/* Count hits on len addresses starting at adr
+ * Not intended to be called directly
+ */
+static void fpga_stats_hits(struct fpga_stats *stats, uint16_t adr, int len)
+{
+	for (; len > 0; len--, adr++) stats->hits[adr]++;
+}
+
+/* Issue messages to the transport, counting and timing them if enabled.
+ * Must be called with the context lock held.
+ *
+ * Not intended to be called directly
+ */
+static int fpga_bus_xfer(struct fpga_ctx *ctx, struct i2c_msg *msgs, int nmsgs)
+{
+	struct fpga_stats *stats = ctx->stats;
+	struct timespec t0, t1;
+	unsigned long long ns;
+	int i, bucket, ret;
+
+	if (stats == NULL) return ctx->transport->xfer(ctx->priv, msgs, nmsgs);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = ctx->transport->xfer(ctx->priv, msgs, nmsgs);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= FPGA_STATS_BUCKETS) bucket = FPGA_STATS_BUCKETS - 1;
+	stats->latency[bucket]++;
+
+	stats->ioctls++;
+	if (ret < 0) stats->errors++;
+	for (i = 0; i < nmsgs; i++) {
+		if (msgs[i].flags & I2C_M_RD) stats->rd_bytes += msgs[i].len;
+		else stats->wr_bytes += msgs[i].len;
+	}
 
-	msg.addr   = i2c_addr;
-	msg.flags  = 0;
-	msg.len	   = 2 + size;
-	msg.buf	   = (char *)outdata;
+	return ret;
+}
+
+/* Send a list of messages to the transport while holding the context lock.
+ * All bus access funnels through here.
+ *
+ * Messages are walked in order, tracking the FPGA address pointer. Writes to
+ * cacheable addresses update the shadow. A read that is entirely in the
+ * shadow is answered from it, and it is dropped along with its address header,
+ * so a transfer of only cached reads never reaches the bus. Once the rest has
+ * completed, cacheable bytes of the remaining reads fill the shadow. If the
+ * transfer fails the FPGA state is unknown, and the whole shadow is dropped.
+ *
+ * Returns < 0 with errno set on failure.
+ * Not intended to be called directly
+ */
+static int fpga_transfer(struct fpga_ctx *ctx, struct i2c_msg *msgs, int nmsgs)
+{
+	struct fpga_cache *cache;
+	struct fpga_stats *stats;
+	struct i2c_msg sent[FPGA_XFER_MAX_MSGS];
+	uint16_t readadr[FPGA_XFER_MAX_MSGS];
+	uint16_t ptr = 0;
+	uint8_t *buf;
+	int i, len, nsent, ret;
+
+	/* fpga_stats_enable() swaps the counters under the lock */
+	pthread_mutex_lock(&ctx->lock);
+	cache = ctx->cache;
+	stats = ctx->stats;
+
+	if (cache == NULL && stats == NULL) {
+		ret = fpga_bus_xfer(ctx, msgs, nmsgs);
+		pthread_mutex_unlock(&ctx->lock);
+		return ret;
+	}
+
+	assert(nmsgs <= FPGA_XFER_MAX_MSGS);
+	for (i = 0, nsent = 0; i < nmsgs; i++) {
+		buf = (uint8_t *)msgs[i].buf;
+
+		if (msgs[i].flags & I2C_M_RD) {
+			if (stats) fpga_stats_hits(stats, ptr, msgs[i].len);
+			/* Only drop a read with its own header, and which
+			 * the next message does not continue from */
+			if (cache && i > 0 && !(msgs[i - 1].flags &
+			  (I2C_M_RD | I2C_M_NOSTART)) && msgs[i - 1].len == 2 &&
+			  (i + 1 == nmsgs || !(msgs[i + 1].flags &
+			  (I2C_M_RD | I2C_M_NOSTART))) &&
+			  fpga_cache_hit(cache, ptr, msgs[i].len)) {
+				memcpy(buf, &cache->shadow[ptr],
+				  msgs[i].len);
+				if (stats) stats->cached_bytes += msgs[i].len;
+				ptr += msgs[i].len;
+				nsent--;
+				continue;
+			}
+			readadr[nsent] = ptr;
+			ptr += msgs[i].len;
+		} else {
+			if (!(msgs[i].flags & I2C_M_NOSTART)) {
+				ptr = (buf[0] << 8) | buf[1];
+				buf += 2;
+			}
+			len = msgs[i].len - (buf - (uint8_t *)msgs[i].buf);
+			if (cache) fpga_cache_fill(cache, ptr, buf, len, 1);
+			if (stats) fpga_stats_hits(stats, ptr, len);
+			ptr += len;
+		}
+		sent[nsent++] = msgs[i];
+	}
+
+	ret = nmsgs;
+	if (nsent) {
+		if (fpga_bus_xfer(ctx, sent, nsent) < 0) {
+			if (cache) memset(cache->valid, 0, sizeof(cache->valid));
+			ret = -1;
+		}
+	}
+
+	for (i = 0; cache && ret >= 0 && i < nsent; i++) {
+		if (!(sent[i].flags & I2C_M_RD)) continue;
+		fpga_cache_fill(cache, readadr[i], (uint8_t *)sent[i].buf,
+		  sent[i].len, 0);
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+/* Large transfers
+ *
+ * fpga_read_range() and fpga_write_range() accept any length. Transfers are
+ * split in to chunks of the largest message the adapter accepts, each chunk
+ * with its own address header, and up to FPGA_XFER_MAX_MSGS messages worth of
+ * chunks are issued in a single I2C_RDWR. A full 8 KiB ZPU RAM load or dump
+ * is one ioctl.
+ *
+ * Each ioctl is atomic with respect to other users of the context, but a
+ * transfer needing more than one ioctl may be interleaved with them.
+ *
+ * Returns 0 on success, 1 on failure.
+ */
+int fpga_read_range(struct fpga_ctx *ctx, uint16_t addr, uint8_t *data,
+  size_t size)
+{
+	struct i2c_msg msgs[FPGA_XFER_MAX_MSGS];
+	uint8_t busaddr[FPGA_XFER_MAX_MSGS / 2][2];
+	size_t len;
+	int nmsgs;
+
+	while (size > 0) {
+		for (nmsgs = 0; size > 0 && nmsgs < FPGA_XFER_MAX_MSGS;
+		  nmsgs += 2) {
+			len = size > ctx->chunk ? ctx->chunk : size;
+
+			busaddr[nmsgs / 2][0] = ((addr >> 8) & 0xff);
+			busaddr[nmsgs / 2][1] = (addr & 0xff);
+
+			msgs[nmsgs].addr      = ctx->i2c_addr;
+			msgs[nmsgs].flags     = 0;
+			msgs[nmsgs].len       = 2;
+			msgs[nmsgs].buf       = (char *)busaddr[nmsgs / 2];
+
+			msgs[nmsgs + 1].addr  = ctx->i2c_addr;
+			msgs[nmsgs + 1].flags = I2C_M_RD;
+			msgs[nmsgs + 1].len   = len;
+			msgs[nmsgs + 1].buf   = (char *)data;
+
+			data += len;
+			addr += len;
+			size -= len;
+		}
+
+		if(fpga_transfer(ctx, msgs, nmsgs) < 0) {
+			perror("Unable to read I2C data");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Write size bytes as chained messages, each address header followed by an
+ * I2C_M_NOSTART message straight from the caller's data, with no copy.
+ * Not intended to be called directly
+ */
+static int fpga_write_chained(struct fpga_ctx *ctx, uint16_t addr,
+  uint8_t *data, size_t size)
+{
+	struct i2c_msg msgs[FPGA_XFER_MAX_MSGS];
+	uint8_t busaddr[FPGA_XFER_MAX_MSGS][2];
+	size_t len;
+	int nmsgs;
 
-	packets.msgs = &msg;
-	packets.nmsgs = 1;
+	while (size > 0) {
+		for (nmsgs = 0; size > 0 && nmsgs < FPGA_XFER_MAX_MSGS;) {
+			len = size > ctx->chunk ? ctx->chunk : size;
+
+			busaddr[nmsgs][0] = ((addr >> 8) & 0xff);
+			busaddr[nmsgs][1] = (addr & 0xff);
+			msgs[nmsgs].addr  = ctx->i2c_addr;
+			msgs[nmsgs].flags = 0;
+			msgs[nmsgs].len   = 2;
+			msgs[nmsgs].buf   = (char *)busaddr[nmsgs];
+			nmsgs++;
+
+			msgs[nmsgs].addr  = ctx->i2c_addr;
+			msgs[nmsgs].flags = I2C_M_NOSTART;
+			msgs[nmsgs].len   = len;
+			msgs[nmsgs].buf   = (char *)data;
+			nmsgs++;
+
+			data += len;
+			addr += len;
+			size -= len;
+		}
 
-	if(ioctl(twifd, I2C_RDWR, &packets) < 0) {
-		perror("Unable to send I2C data");
-		return 1;
+		if(fpga_transfer(ctx, msgs, nmsgs) < 0) {
+			perror("Unable to send I2C data");
+			return 1;
+		}
 	}
+
 	return 0;
 }
 
-void fpoke8(int twifd, uint16_t addr, uint8_t data)
+/* Write size bytes with each chunk copied behind its address in to a bounce
+ * buffer. Small writes bounce on the stack, larger ones need room for as many
+ * chunks as go in one ioctl. Kept out of line so that the stack buffer is only
+ * taken on adapters without I2C_M_NOSTART.
+ * Not intended to be called directly
+ */
+static __attribute__((noinline)) int fpga_write_bounce(struct fpga_ctx *ctx,
+  uint16_t addr, uint8_t *data, size_t size)
+{
+	struct i2c_msg msgs[FPGA_XFER_MAX_MSGS];
+	uint8_t small[FPGA_MAX_CHUNK + 2];
+	uint8_t *bounce = small, *out;
+	size_t len, per, bouncesz;
+	int nmsgs, ret = 0;
+
+	per = FPGA_XFER_MAX_MSGS * ctx->chunk;
+	bouncesz = (size > per ? per : size) + (2 * FPGA_XFER_MAX_MSGS);
+	if (bouncesz > sizeof(small)) {
+		bounce = malloc(bouncesz);
+		if (bounce == NULL) {
+			perror("Unable to send I2C data");
+			return 1;
+		}
+	}
+
+	while (size > 0) {
+		out = bounce;
+		for (nmsgs = 0; size > 0 && nmsgs < FPGA_XFER_MAX_MSGS;) {
+			len = size > ctx->chunk ? ctx->chunk : size;
+
+			out[0] = ((addr >> 8) & 0xff);
+			out[1] = (addr & 0xff);
+			memcpy(&out[2], data, len);
+			msgs[nmsgs].addr  = ctx->i2c_addr;
+			msgs[nmsgs].flags = 0;
+			msgs[nmsgs].len   = 2 + len;
+			msgs[nmsgs].buf   = (char *)out;
+			out += 2 + len;
+			nmsgs++;
+
+			data += len;
+			addr += len;
+			size -= len;
+		}
+
+		if(fpga_transfer(ctx, msgs, nmsgs) < 0) {
+			perror("Unable to send I2C data");
+			ret = 1;
+			break;
+		}
+	}
+
+	if (bounce != small) free(bounce);
+
+	return ret;
+}
+
+/* If the adapter supports I2C_M_NOSTART, each address header and its data
+ * are sent as two chained messages with no copy of the caller's data.
+ * Otherwise, each chunk is copied behind its address in to a bounce buffer.
+ */
+int fpga_write_range(struct fpga_ctx *ctx, uint16_t addr, uint8_t *data,
+  size_t size)
+{
+	if (ctx->nostart) return fpga_write_chained(ctx, addr, data, size);
+
+	return fpga_write_bounce(ctx, addr, data, size);
+}
+
+int fpeekstream8(struct fpga_ctx *ctx, uint8_t *data, uint16_t addr, int size)
+{
+	return fpga_read_range(ctx, addr, data, size);
+}
+
+int fpokestream8(struct fpga_ctx *ctx, uint8_t *data, uint16_t addr, int size)
+{
+	return fpga_write_range(ctx, addr, data, size);
+}
+
+void fpoke8(struct fpga_ctx *ctx, uint16_t addr, uint8_t data)
 {
 	int ret;
 
-	ret = fpokestream8(twifd, &data, addr, 1);
+	ret = fpokestream8(ctx, &data, addr, 1);
 	if (ret) {
 		perror("Failed to write to FPGA");
 	}
 }
 
-uint8_t fpeek8(int twifd, uint16_t addr)
+uint8_t fpeek8(struct fpga_ctx *ctx, uint16_t addr)
 {
 	uint8_t data = 0;
 	int ret;
-	ret = fpeekstream8(twifd, &data, addr, 1);
+	ret = fpeekstream8(ctx, &data, addr, 1);
 
 	if (ret) {
 		perror("Failed to read from FPGA");
 	}
 	return data;
 }
+
+/* Batched transactions
+ *
+ * Every peek and poke above is its own I2C_RDWR transaction, meaning a syscall
+ * and a full bus turnaround per register access. The kernel accepts up to
+ * FPGA_XFER_MAX_MSGS messages in a single I2C_RDWR, each separated on the bus
+ * by a repeated start. The fpga_xfer_* functions queue up any number of peeks
+ * and pokes and issue them all at once from fpga_xfer_commit().
+ *
+ * Operations are always executed on the bus in the order they were added.
+ * Peeks read straight in to the caller's buffer, which must remain valid until
+ * the transaction is committed. Poke data is copied in to the transaction at
+ * the time it is added, so the caller's buffer may be reused immediately.
+ *
+ * If an add would overflow the message list or the poke buffer, everything
+ * queued up to that point is committed first, and the add is then placed in
+ * a fresh transaction. This means a transaction never fails to accept an
+ * operation, but very large batches will be split across multiple ioctls.
+ *
+ * Typical usage:
+ *
+ *   struct fpga_xfer xfer;
+ *
+ *   fpga_xfer_begin(&xfer, fpga);
+ *   fpga_xfer_poke8(&xfer, 0x80 + out, in);
+ *   fpga_xfer_peek8(&xfer, 0x80 + out, &val);
+ *   if (fpga_xfer_commit(&xfer)) ...
+ */
+
+void fpga_xfer_begin(struct fpga_xfer *xfer, struct fpga_ctx *ctx)
+{
+	xfer->ctx = ctx;
+	xfer->nmsgs = 0;
+	xfer->buflen = 0;
+}
+
+/* Make room for nmsgs messages and buflen bytes of address/poke data,
+ * committing what is currently queued if needed.
+ *
+ * Returns 0 on success, 1 if the early commit failed.
+ * Not intended to be called directly
+ */
+static int fpga_xfer_reserve(struct fpga_xfer *xfer, int nmsgs, int buflen)
+{
+	int ret = 0;
+
+	assert(nmsgs <= FPGA_XFER_MAX_MSGS && buflen <= FPGA_XFER_BUF_SZ);
+
+	if ((xfer->nmsgs + nmsgs) > FPGA_XFER_MAX_MSGS ||
+	  (xfer->buflen + buflen) > FPGA_XFER_BUF_SZ) {
+		ret = fpga_xfer_commit(xfer);
+	}
+
+	return ret;
+}
+
+int fpga_xfer_peekstream8(struct fpga_xfer *xfer, uint8_t *data, uint16_t addr,
+  int size)
+{
+	struct i2c_msg *msgs;
+	uint8_t *busaddr;
+	int ret;
+
+	/* Linux only supports 4k transactions at a time */
+	assert(size <= FPGA_MAX_CHUNK);
+
+	ret = fpga_xfer_reserve(xfer, 2, 2);
+
+	busaddr = &xfer->buf[xfer->buflen];
+	busaddr[0] = ((addr >> 8) & 0xff);
+	busaddr[1] = (addr & 0xff);
+	xfer->buflen += 2;
+
+	msgs = &xfer->msgs[xfer->nmsgs];
+	msgs[0].addr  = xfer->ctx->i2c_addr;
+	msgs[0].flags = 0;
+	msgs[0].len   = 2;
+	msgs[0].buf   = (char *)busaddr;
+
+	msgs[1].addr  = xfer->ctx->i2c_addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len   = size;
+	msgs[1].buf   = (char *)data;
+	xfer->nmsgs += 2;
+
+	return ret;
+}
+
+int fpga_xfer_pokestream8(struct fpga_xfer *xfer, uint8_t *data, uint16_t addr,
+  int size)
+{
+	struct i2c_msg *msg;
+	uint8_t *outdata;
+	int ret;
+
+	/* Linux only supports 4k transactions at a time, and we need
+	 * two bytes for the address */
+	assert(size <= FPGA_MAX_CHUNK);
+
+	ret = fpga_xfer_reserve(xfer, 1, 2 + size);
+
+	outdata = &xfer->buf[xfer->buflen];
+	outdata[0] = ((addr >> 8) & 0xff);
+	outdata[1] = (addr & 0xff);
+	memcpy(&outdata[2], data, size);
+	xfer->buflen += 2 + size;
+
+	msg = &xfer->msgs[xfer->nmsgs];
+	msg->addr  = xfer->ctx->i2c_addr;
+	msg->flags = 0;
+	msg->len   = 2 + size;
+	msg->buf   = (char *)outdata;
+	xfer->nmsgs++;
+
+	return ret;
+}
+
+int fpga_xfer_peek8(struct fpga_xfer *xfer, uint16_t addr, uint8_t *data)
+{
+	return fpga_xfer_peekstream8(xfer, data, addr, 1);
+}
+
+int fpga_xfer_poke8(struct fpga_xfer *xfer, uint16_t addr, uint8_t data)
+{
+	return fpga_xfer_pokestream8(xfer, &data, addr, 1);
+}
+
+/* Issue everything queued in the transaction as a single I2C_RDWR ioctl.
+ * The transaction is left empty and may be reused for further operations.
+ *
+ * Returns 0 on success, 1 on failure. On failure, the contents of any peek
+ * buffers in the failed batch are undefined.
+ */
+int fpga_xfer_commit(struct fpga_xfer *xfer)
+{
+	int ret = 0;
+
+	if (xfer->nmsgs) {
+		if(fpga_transfer(xfer->ctx, xfer->msgs, xfer->nmsgs) < 0) {
+			perror("Unable to transfer I2C data");
+			ret = 1;
+		}
+	}
+
+	xfer->nmsgs = 0;
+	xfer->buflen = 0;
+
+	return ret;
+}
@@ -1,12 +1,92 @@
 #ifndef __FPGA_H_
 #define __FPGA_H_
 
-int fpga_init(const char *i2c_bus, uint8_t addr);
-int fpga_deinit(int twifd);
-int fpeekstream8(int twifd,  uint8_t *data, uint16_t addr, int size);
-int fpokestream8(int twifd, uint8_t *data, uint16_t addr, int size);
-uint8_t fpeek8(int twifd, uint16_t addr);
-void fpoke8(int twifd, uint16_t addr, uint8_t data);
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
 
-#endif
+#include "i2c-dev.h"
+
+/* Largest data payload in a single fpga_xfer peek or poke. Linux only supports
+ * 4k transactions at a time, and writes need two bytes for the address. */
+#define FPGA_MAX_CHUNK		4094
+
+/* The kernel limits a single I2C_RDWR to 42 messages (I2C_RDWR_IOCTL_MAX_MSGS)
+ * Poke data for a batch is staged in the transaction itself. */
+#define FPGA_XFER_MAX_MSGS	42
+#define FPGA_XFER_BUF_SZ	4096
+
+/* Latency histogram buckets, the last also holds anything slower */
+#define FPGA_STATS_BUCKETS	32
+
+/* Bus statistics, see fpga_stats_enable() */
+struct fpga_stats {
+	unsigned long ioctls;		/* Transfers issued to the transport */
+	unsigned long errors;		/* Transfers that failed */
+	unsigned long long rd_bytes;	/* Bytes read from the bus */
+	unsigned long long wr_bytes;	/* Bytes written, including addresses */
+	unsigned long long cached_bytes;/* Bytes read from the shadow cache */
+	unsigned long latency[FPGA_STATS_BUCKETS]; /* [2^n, 2^n+1) ns */
+	uint32_t hits[0x10000];		/* Reads and writes of each address */
+};
+
+/* Opaque handle for one FPGA on one bus, see fpga.c */
+struct fpga_ctx;
 
+/* A batch of FPGA register operations issued with one I2C_RDWR ioctl.
+ * See fpga.c for usage, members are not intended to be accessed directly. */
+struct fpga_xfer {
+	struct fpga_ctx *ctx;
+	int nmsgs;
+	int buflen;
+	struct i2c_msg msgs[FPGA_XFER_MAX_MSGS];
+	uint8_t buf[FPGA_XFER_BUF_SZ];
+};
+
+/* Bus transport, see fpga.c. open() stores per-instance state in priv, which
+ * is passed back to the other calls. All return < 0 with errno set on failure.
+ * xfer() takes the same message list as the I2C_RDWR ioctl. funcs() returns
+ * the I2C_FUNC_* capabilities of the adapter. max_len is the largest single
+ * message the adapter accepts. irq_fd() and irq_level() are optional, for a
+ * transport that also provides the FPGA IRQ line, see fpga_irq_fd(). */
+struct fpga_transport {
+	const char *name;
+	int max_len;
+	int (*open)(void **priv, const char *opts, uint8_t addr);
+	int (*xfer)(void *priv, struct i2c_msg *msgs, int nmsgs);
+	unsigned long (*funcs)(void *priv);
+	int (*close)(void *priv);
+	int (*irq_fd)(void *priv);
+	int (*irq_level)(void *priv);
+};
+
+int fpga_simulated(void);
+struct fpga_ctx *fpga_init(const char *i2c_bus, uint8_t addr);
+int fpga_deinit(struct fpga_ctx *ctx);
+int fpeekstream8(struct fpga_ctx *ctx, uint8_t *data, uint16_t addr, int size);
+int fpokestream8(struct fpga_ctx *ctx, uint8_t *data, uint16_t addr, int size);
+uint8_t fpeek8(struct fpga_ctx *ctx, uint16_t addr);
+int fpga_read_range(struct fpga_ctx *ctx, uint16_t addr, uint8_t *data,
+  size_t size);
+int fpga_write_range(struct fpga_ctx *ctx, uint16_t addr, uint8_t *data,
+  size_t size);
+void fpoke8(struct fpga_ctx *ctx, uint16_t addr, uint8_t data);
+void fpga_cache_set(struct fpga_ctx *ctx, uint16_t addr, size_t len,
+  int cacheable);
+void fpga_cache_invalidate(struct fpga_ctx *ctx);
+int fpga_stats_enable(struct fpga_ctx *ctx);
+int fpga_stats_get(struct fpga_ctx *ctx, struct fpga_stats *stats);
+void fpga_stats_print(struct fpga_ctx *ctx, FILE *f);
+int fpga_irq_fd(struct fpga_ctx *ctx);
+int fpga_irq_level(struct fpga_ctx *ctx);
+
+void fpga_xfer_begin(struct fpga_xfer *xfer, struct fpga_ctx *ctx);
+int fpga_xfer_peekstream8(struct fpga_xfer *xfer, uint8_t *data, uint16_t addr,
+  int size);
+int fpga_xfer_pokestream8(struct fpga_xfer *xfer, uint8_t *data, uint16_t addr,
+  int size);
+int fpga_xfer_peek8(struct fpga_xfer *xfer, uint16_t addr, uint8_t *data);
+int fpga_xfer_poke8(struct fpga_xfer *xfer, uint16_t addr, uint8_t data);
+int fpga_xfer_commit(struct fpga_xfer *xfer);
+
+#endif
@@ -0,0 +1,294 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Asynchronous FPGA access
+ *
+ * Every call in fpga.c blocks the caller for the full I2C round trip. This
+ * layer lets any number of threads queue up peeks and pokes without waiting
+ * on the bus. A single worker thread owns the FPGA context, pulls everything
+ * that has been queued, and merges as many requests as possible in to each
+ * fpga_xfer transaction, so unrelated users of the FPGA share bus
+ * turnarounds rather than taking turns.
+ *
+ * Requests are placed in a bounded lock-free ring, safe for multiple
+ * producers, with the worker as the only consumer. Completion is reported
+ * either with a callback, run on the worker thread, or by waiting on the
+ * request like a future:
+ *
+ *   struct fpga_req req = {
+ *     .op = FPGA_REQ_PEEK, .addr = 304, .data = buf, .size = 5,
+ *   };
+ *
+ *   fpga_async_submit(q, &req);
+ *   ... other work ...
+ *   if (fpga_async_wait(q, &req)) ...
+ *
+ * Requests from the same thread are always executed in the order they were
+ * submitted. Requests from different threads are executed in the order they
+ * were claimed in the ring.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fpga_async.h"
+
+/* Each ring slot carries a sequence number. A producer may fill a slot when
+ * its sequence equals the position being claimed; the consumer may take it
+ * when the sequence equals position + 1.
+ */
+struct fpga_slot {
+	unsigned int seq;
+	struct fpga_req *req;
+};
+
+struct fpga_async {
+	struct fpga_ctx *ctx;
+	struct fpga_slot *ring;
+	unsigned int mask;
+	unsigned int head;	/* next position for producers to claim */
+	unsigned int tail;	/* next position for the consumer, worker only */
+	sem_t pending;
+	int stop;
+	pthread_t worker;
+	pthread_mutex_t lock;	/* only protects waiters on done */
+	pthread_cond_t done;
+};
+
+/* Take the request at the ring tail. Only called once the pending semaphore
+ * says there is a request, but a producer that claimed the slot may still be
+ * in the middle of filling it in, in which case spin until it is published.
+ *
+ * Returns NULL if nothing has been claimed, which only happens for the extra
+ * wakeup posted by fpga_async_stop().
+ *
+ * Not intended to be called directly
+ */
+static struct fpga_req *fpga_async_pop(struct fpga_async *q)
+{
+	struct fpga_slot *slot = &q->ring[q->tail & q->mask];
+	struct fpga_req *req;
+
+	if (q->tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != q->tail + 1);
+
+	req = slot->req;
+	__atomic_store_n(&slot->seq, q->tail + q->mask + 1, __ATOMIC_RELEASE);
+	q->tail++;
+
+	return req;
+}
+
+/* Mark a batch of requests complete and wake anyone waiting.
+ * Not intended to be called directly
+ */
+static void fpga_async_complete(struct fpga_async *q, struct fpga_req **reqs,
+  int nreqs, int status)
+{
+	int i;
+
+	for (i = 0; i < nreqs; i++) {
+		reqs[i]->status = status;
+		if (reqs[i]->done) reqs[i]->done(reqs[i], reqs[i]->arg);
+		__atomic_store_n(&reqs[i]->complete, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->done);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Bus-owner thread
+ *
+ * Block until at least one request is queued, then keep pulling requests for
+ * as long as more are immediately available and they fit in one transaction.
+ * Commit, complete the whole batch, and go again.
+ *
+ * Not intended to be called directly
+ */
+static void *fpga_async_worker(void *arg)
+{
+	struct fpga_async *q = arg;
+	struct fpga_req *reqs[FPGA_XFER_MAX_MSGS];
+	struct fpga_req *next = NULL;
+	struct fpga_xfer xfer;
+	int nreqs, msgs, buflen, need_msgs, need_buf, ret;
+
+	while (1) {
+		if (next == NULL) {
+			if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE) &&
+			  q->tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+				break;
+			while (sem_wait(&q->pending) && errno == EINTR);
+			next = fpga_async_pop(q);
+			if (next == NULL) continue;
+		}
+
+		fpga_xfer_begin(&xfer, q->ctx);
+		nreqs = msgs = buflen = 0;
+
+		while (next != NULL) {
+			if (next->op == FPGA_REQ_PEEK) {
+				need_msgs = 2;
+				need_buf = 2;
+			} else {
+				need_msgs = 1;
+				need_buf = 2 + next->size;
+			}
+			if ((msgs + need_msgs) > FPGA_XFER_MAX_MSGS ||
+			  (buflen + need_buf) > FPGA_XFER_BUF_SZ)
+				break;
+
+			if (next->op == FPGA_REQ_PEEK) {
+				fpga_xfer_peekstream8(&xfer, next->data,
+				  next->addr, next->size);
+			} else {
+				fpga_xfer_pokestream8(&xfer, next->data,
+				  next->addr, next->size);
+			}
+			msgs += need_msgs;
+			buflen += need_buf;
+			reqs[nreqs++] = next;
+			next = NULL;
+
+			if (sem_trywait(&q->pending) == 0)
+				next = fpga_async_pop(q);
+		}
+
+		ret = fpga_xfer_commit(&xfer);
+		fpga_async_complete(q, reqs, nreqs, ret);
+	}
+
+	return NULL;
+}
+
+/* Start an asynchronous queue on ctx with room for depth outstanding
+ * requests, rounded up to a power of two.
+ *
+ * Returns NULL on failure
+ */
+struct fpga_async *fpga_async_start(struct fpga_ctx *ctx, unsigned int depth)
+{
+	struct fpga_async *q;
+	unsigned int sz, i;
+
+	for (sz = 2; sz < depth; sz <<= 1);
+
+	q = calloc(1, sizeof(struct fpga_async));
+	if (q == NULL) return NULL;
+	q->ring = calloc(sz, sizeof(struct fpga_slot));
+	if (q->ring == NULL) {
+		free(q);
+		return NULL;
+	}
+
+	for (i = 0; i < sz; i++) q->ring[i].seq = i;
+	q->mask = sz - 1;
+	q->ctx = ctx;
+	sem_init(&q->pending, 0, 0);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->done, NULL);
+
+	/* pthread_create() returns the error rather than setting errno */
+	errno = pthread_create(&q->worker, NULL, fpga_async_worker, q);
+	if (errno) {
+		perror("Unable to start FPGA worker");
+		sem_destroy(&q->pending);
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->done);
+		free(q->ring);
+		free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/* Finish all queued requests and stop the worker thread. The FPGA context
+ * is left open.
+ */
+void fpga_async_stop(struct fpga_async *q)
+{
+	__atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&q->pending);
+	pthread_join(q->worker, NULL);
+
+	sem_destroy(&q->pending);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->done);
+	free(q->ring);
+	free(q);
+}
+
+/* Queue a request. Safe to call from any thread, including from a completion
+ * callback.
+ *
+ * Returns 0 on success, -1 with errno set to EAGAIN if the ring is full or
+ * EINVAL if the request is too large for a single I2C transaction.
+ */
+int fpga_async_submit(struct fpga_async *q, struct fpga_req *req)
+{
+	struct fpga_slot *slot;
+	unsigned int pos, seq;
+
+	/* Peeks are limited by the message length, pokes also need to fit
+	 * with their address in the transaction buffer */
+	if (req->size < 1 || req->size > FPGA_MAX_CHUNK) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	req->status = 0;
+	req->complete = 0;
+
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &q->ring[pos & q->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+			  1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int)(seq - pos) < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->req = req;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&q->pending);
+
+	return 0;
+}
+
+/* Returns 1 if the request has completed, without blocking */
+int fpga_async_done(struct fpga_req *req)
+{
+	return __atomic_load_n(&req->complete, __ATOMIC_ACQUIRE);
+}
+
+/* Block until the request has completed.
+ *
+ * Returns the request status, 0 on success.
+ */
+int fpga_async_wait(struct fpga_async *q, struct fpga_req *req)
+{
+	if (!fpga_async_done(req)) {
+		pthread_mutex_lock(&q->lock);
+		while (!fpga_async_done(req))
+			pthread_cond_wait(&q->done, &q->lock);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return req->status;
+}
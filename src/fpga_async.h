@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef __FPGA_ASYNC_H_
+#define __FPGA_ASYNC_H_
+
+#include <stdint.h>
+
+#include "fpga.h"
+
+enum fpga_req_op {
+	FPGA_REQ_PEEK = 0,
+	FPGA_REQ_POKE = 1,
+};
+
+/* A single asynchronous FPGA access. The request and its data buffer are
+ * owned by the caller and must remain valid until the request completes.
+ * done may be NULL, in which case fpga_async_wait() is used to wait on the
+ * request. status is 0 on success, 1 if the I2C transfer failed. */
+struct fpga_req {
+	enum fpga_req_op op;
+	uint16_t addr;
+	uint8_t *data;
+	int size;
+	void (*done)(struct fpga_req *req, void *arg);
+	void *arg;
+	int status;
+	int complete;
+};
+
+/* Opaque queue and bus-owner thread, see fpga_async.c */
+struct fpga_async;
+
+struct fpga_async *fpga_async_start(struct fpga_ctx *ctx, unsigned int depth);
+void fpga_async_stop(struct fpga_async *q);
+int fpga_async_submit(struct fpga_async *q, struct fpga_req *req);
+int fpga_async_done(struct fpga_req *req);
+int fpga_async_wait(struct fpga_async *q, struct fpga_req *req);
+
+#endif
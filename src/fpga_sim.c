@@ -0,0 +1,1120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Simulated TS-4100 FPGA
+ *
+ * This is a userspace model of the FPGA as seen from the I2C bus. It allows
+ * all of the tools that use fpga.c to be run, profiled, and tested on any
+ * Linux machine without a TS-4100. It is selected by passing a bus name of
+ * "sim" to fpga_init(), or by setting the FPGA_BUS environment variable to
+ * "sim", which overrides the bus that every tool opens.
+ *
+ * Options can be appended to the bus name, e.g.
+ *
+ *   FPGA_BUS=sim:latency=150,khz=400 tshwctl --info
+ *
+ *   latency=<us>  Fixed cost added to every I2C_RDWR transaction. Defaults
+ *                   to 0.
+ *   khz=<clk>     Model the time on the wire for the given I2C clock, each
+ *                   byte costing 9 bit times. Defaults to 0, no wire time.
+ *   rev=<rev>     FPGA revision reported at 306. Defaults to 0xF.
+ *   nostart=<0|1> Whether the adapter reports I2C_FUNC_NOSTART. Defaults
+ *                   to 1.
+ *   zpu=bench     Run a native stand in for the zpu/zpu_bench.c firmware, see
+ *                   "ZPU bench peer" below, for tszpubench.
+ *   zpu=muxbus    Run a native stand in for the zpu/zpu_muxbus.c firmware,
+ *                   with a MUXBUS of plain 16-bit registers behind it.
+ *   txfifo=<sz>   ZPU TX and RX FIFO sizes of the ZPU peer. Default to 256
+ *   rxfifo=<sz>     and 16, as in zpu/fifo.c.
+ *   zpu=emu       Run whatever firmware is in ZPU RAM on an emulated ZPU, see
+ *                   "ZPU emulator" below. As on hardware, the ZPU stays in
+ *                   reset until released through 19, e.g. by tszpuctl -l.
+ *   zpubin=<path> Load a firmware .bin, the same image tszpuctl -l writes,
+ *                   and start it on the emulated ZPU. Implies zpu=emu.
+ *   zpustats=1    Print the cycles and instructions of the emulated ZPU to
+ *                   stderr on close.
+ *
+ * Every FPGA context opened on the sim transport gets its own independent
+ * model, a flat 64 KiB register file. The FPGA I2C protocol is followed: a
+ * write message starts with a 2 byte big-endian address, and any further bytes
+ * of the write, bytes of following I2C_M_NOSTART writes, or bytes of following
+ * read messages, auto increment from there. The following are modeled
+ * specifically:
+ *
+ *   304-305   Model, 0x4100, read only
+ *   306       FPGA revision, read only
+ *   307       FPGA sub-revision, 0 for stock builds, read only
+ *   308       Opts, read only
+ *   18        ZPU status, bit 2 set while the emulated ZPU is in break
+ *   19        ZPU reset/control, powers up in reset (0x3)
+ *   0x2000-0x3FFF  ZPU RAM
+ *
+ * All other addresses behave as plain read/write storage.
+ *
+ * The FPGA IRQ line is modeled too, see fpga_irq_fd(). As on hardware, it is
+ * raised with an FPGA address by the ZPU, and lowered when the CPU reads that
+ * address.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "fpga_sim.h"
+
+#define SIM_MODEL_ADR	304
+#define SIM_REV_ADR	306
+#define SIM_SUB_ADR	307
+#define SIM_OPTS_ADR	308
+#define SIM_ZPU_STAT_ADR	18
+#define SIM_ZPU_CTL_ADR	19
+
+#define SIM_ZPU_RAM	0x2000
+/* Where the bench peer places its FIFO struct, in ZPU addressing */
+#define SIM_ZPU_FIFO	0x1000
+/* Firmware the ZPU peer stands in for */
+#define SIM_PEER_BENCH	1
+#define SIM_PEER_MUXBUS	2
+#define SIM_PEER_EMU	3
+
+/* Emulated ZPU, see sim_zpu_step() */
+struct sim_zpu {
+	uint32_t pc, sp;
+	int idim;
+	/* Output enable, output and IRQ1 registers, and the MUXBUS cycle
+	 * decoded from the DIO, see sim_zpu_muxbus() */
+	uint32_t oe[3], o[3], irq1;
+	uint16_t mb_adr;
+	int mb_read;
+	/* Firmware to load on open, and counters for zpustats=1 */
+	char *image;
+	int stats;
+	unsigned long long cycles, insns, emulated;
+	unsigned long traps[32];
+};
+
+/* Each open of the sim transport is an independent FPGA */
+struct sim_fpga {
+	uint8_t regs[0x10000];
+	uint16_t ptr;
+	unsigned long latency_ns;
+	unsigned long byte_ns;
+	int nostart;
+	/* Serializes the register file between transfers and the bench peer */
+	pthread_mutex_t lock;
+	/* IRQ line, the address that lowers it, and the eventfd for edges */
+	int irq;
+	uint16_t irq_adr;
+	int irqfd;
+	/* ZPU bench peer, see sim_bench_main(), and the MUXBUS behind the
+	 * MUXBUS peer */
+	int bench;
+	uint16_t muxbus[0x10000];
+	volatile int bench_stop;
+	pthread_t bench_thread;
+	uint16_t txsz, rxsz;
+	uint16_t txput, rxget, txget_last, rxput_last;
+	/* Coalesced IRQ held back, and when, see sim_bench_tx_irq() */
+	int irq_pending;
+	long long irq_since_ns;
+	struct sim_zpu zpu;
+};
+
+/* Parse the comma separated options after "sim:"
+ * Not intended to be called directly
+ */
+static void sim_parse_opts(struct sim_fpga *sim, const char *opts)
+{
+	char *buf, *tok, *save;
+	unsigned long val;
+
+	if (opts == NULL) return;
+
+	buf = strdup(opts);
+	assert(buf != NULL);
+
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	  tok = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(tok, "latency=", 8)) {
+			sim->latency_ns = strtoul(tok + 8, NULL, 0) * 1000;
+		} else if (!strncmp(tok, "khz=", 4)) {
+			val = strtoul(tok + 4, NULL, 0);
+			sim->byte_ns = val ? (9 * 1000000) / val : 0;
+		} else if (!strncmp(tok, "nostart=", 8)) {
+			sim->nostart = !!strtoul(tok + 8, NULL, 0);
+		} else if (!strncmp(tok, "rev=", 4)) {
+			sim->regs[SIM_REV_ADR] = (uint8_t)strtoul(tok + 4, NULL, 0);
+		} else if (!strcmp(tok, "zpu=bench")) {
+			sim->bench = SIM_PEER_BENCH;
+		} else if (!strcmp(tok, "zpu=muxbus")) {
+			sim->bench = SIM_PEER_MUXBUS;
+		} else if (!strcmp(tok, "zpu=emu")) {
+			sim->bench = SIM_PEER_EMU;
+		} else if (!strncmp(tok, "zpubin=", 7)) {
+			sim->bench = SIM_PEER_EMU;
+			free(sim->zpu.image);
+			sim->zpu.image = strdup(tok + 7);
+			assert(sim->zpu.image != NULL);
+		} else if (!strncmp(tok, "zpustats=", 9)) {
+			sim->zpu.stats = !!strtoul(tok + 9, NULL, 0);
+		} else if (!strncmp(tok, "txfifo=", 7)) {
+			sim->txsz = strtoul(tok + 7, NULL, 0);
+		} else if (!strncmp(tok, "rxfifo=", 7)) {
+			sim->rxsz = strtoul(tok + 7, NULL, 0);
+		} else {
+			fprintf(stderr, "Unknown FPGA sim option \"%s\"\n", tok);
+		}
+	}
+
+	free(buf);
+}
+
+/* Busy-wait rather than sleep, the delays modeled here are generally shorter
+ * than the scheduler can accurately provide.
+ * Not intended to be called directly
+ */
+static void sim_delay(unsigned long ns)
+{
+	struct timespec start, now;
+
+	if (ns == 0) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (((now.tv_sec - start.tv_sec) * 1000000000L +
+	  (now.tv_nsec - start.tv_nsec)) < (long)ns);
+}
+
+/* Raise the IRQ line with the FPGA address that lowers it again, signaling
+ * the eventfd on a rising edge. Must be called with the sim lock held.
+ * Not intended to be called directly
+ */
+static void sim_irq_raise(struct sim_fpga *sim, uint16_t adr)
+{
+	uint64_t one = 1;
+
+	sim->irq_adr = adr;
+	if (!sim->irq) {
+		sim->irq = 1;
+		write(sim->irqfd, &one, sizeof(one));
+	}
+}
+
+/* ZPU bench peer
+ *
+ * A native thread standing in for the zpu/zpu_bench.c firmware running on
+ * the ZPU, so tszpubench can run against the simulated FPGA. It follows the
+ * same command protocol, and keeps its FIFO in the ZPU RAM of the register
+ * file exactly as zpu/fifo.c does, including flow control, the cursor
+ * format, and raising or coalescing the IRQ. Each FIFO access is done under
+ * the sim lock, so is atomic to the CPU as ZPU word accesses are.
+ */
+
+static uint32_t sim_rd32(struct sim_fpga *sim, uint16_t adr)
+{
+	return (sim->regs[adr] << 24) | (sim->regs[adr + 1] << 16) |
+	  (sim->regs[adr + 2] << 8) | sim->regs[adr + 3];
+}
+
+static void sim_wr32(struct sim_fpga *sim, uint16_t adr, uint32_t val)
+{
+	sim->regs[adr] = val >> 24;
+	sim->regs[adr + 1] = val >> 16;
+	sim->regs[adr + 2] = val >> 8;
+	sim->regs[adr + 3] = val;
+}
+
+/* FPGA addresses of the FIFO struct members, as laid out by zpu/fifo.c */
+#define SIM_FIFO_FLAGS(s)	(SIM_ZPU_RAM + SIM_ZPU_FIFO)
+#define SIM_FIFO_TXPUT(s)	(SIM_FIFO_FLAGS(s) + 4)
+#define SIM_FIFO_TXGET(s)	(SIM_FIFO_FLAGS(s) + 8)
+#define SIM_FIFO_TXDAT(s)	(SIM_FIFO_FLAGS(s) + 12)
+#define SIM_FIFO_RXPUT(s)	(SIM_FIFO_TXDAT(s) + (((s)->txsz + 3) & ~3))
+#define SIM_FIFO_RXGET(s)	(SIM_FIFO_RXPUT(s) + 4)
+#define SIM_FIFO_RXDAT(s)	(SIM_FIFO_RXGET(s) + 4)
+#define SIM_FIFO_COALESCE(s)	(SIM_FIFO_RXDAT(s) + (((s)->rxsz + 3) & ~3))
+
+/* Cursor as written by the ZPU, and a cursor written by the CPU, which is
+ * only taken if it is not mid update
+ */
+#define SIM_CURSOR(pos)		((pos) | (((pos) & 0xff00) << 8))
+static uint16_t sim_cursor(uint32_t val, uint16_t *last)
+{
+	if (((val >> 16) & 0xff) == ((val >> 8) & 0xff)) *last = val & 0xffff;
+	return *last;
+}
+
+static long long sim_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* IRQ0 on the TX FIFO head, as fifo_irq(). Called with the sim lock held. */
+static void sim_bench_irq(struct sim_fpga *sim)
+{
+	sim->irq_pending = 0;
+	sim_irq_raise(sim, SIM_FIFO_TXPUT(sim) + 3);
+}
+
+/* fifo_poll(), the timeout is in units of 1024 ticks of the 63 MHz timer.
+ * Called with the sim lock held. */
+static void sim_bench_poll(struct sim_fpga *sim)
+{
+	long long timeout = sim_rd32(sim, SIM_FIFO_COALESCE(sim)) >> 16;
+
+	if (sim->irq_pending && timeout &&
+	  (sim_now_ns() - sim->irq_since_ns) * 63 / 1000 / 1024 >= timeout)
+		sim_bench_irq(sim);
+}
+
+/* fifo_tx_irq(), the IRQ after data is put, held back as the CPU set in the
+ * coalesce word. Called with the sim lock held. */
+static void sim_bench_tx_irq(struct sim_fpga *sim)
+{
+	uint32_t coalesce = sim_rd32(sim, SIM_FIFO_COALESCE(sim));
+	uint16_t get;
+	int waiting;
+
+	if (coalesce == 0) {
+		sim_bench_irq(sim);
+		return;
+	}
+
+	get = sim_cursor(sim_rd32(sim, SIM_FIFO_TXGET(sim)), &sim->txget_last);
+	waiting = (sim->txput + sim->txsz - get) % sim->txsz;
+	if ((coalesce & 0xffff) && waiting >= (int)(coalesce & 0xffff)) {
+		sim_bench_irq(sim);
+		return;
+	}
+
+	if (!sim->irq_pending) {
+		sim->irq_pending = 1;
+		sim->irq_since_ns = sim_now_ns();
+	}
+	sim_bench_poll(sim);
+}
+
+/* Where the ZPU would be spinning. A sleep here would be rounded up to the
+ * timer slack, tens of us, and swamp the host side costs being measured. */
+static void sim_bench_idle(void)
+{
+	sched_yield();
+}
+
+/* getc(), waiting for a byte. Returns -1 once the peer is stopped. */
+static int sim_bench_getc(struct sim_fpga *sim)
+{
+	int c;
+
+	while (!sim->bench_stop) {
+		pthread_mutex_lock(&sim->lock);
+		sim_bench_poll(sim);
+		if (sim->rxget != sim_cursor(sim_rd32(sim, SIM_FIFO_RXPUT(sim)),
+		  &sim->rxput_last)) {
+			c = sim->regs[SIM_FIFO_RXDAT(sim) + sim->rxget];
+			sim->rxget = (sim->rxget + 1) % sim->rxsz;
+			sim_wr32(sim, SIM_FIFO_RXGET(sim), SIM_CURSOR(sim->rxget));
+			pthread_mutex_unlock(&sim->lock);
+			return c;
+		}
+		pthread_mutex_unlock(&sim->lock);
+		sim_bench_idle();
+	}
+
+	return -1;
+}
+
+/* Wait for fifo_avail() to reach len, then fifo_read() len bytes. Returns -1
+ * once the peer is stopped. */
+static int sim_bench_read(struct sim_fpga *sim, uint8_t *buf, int len)
+{
+	uint16_t put;
+	int avail, n;
+
+	while (!sim->bench_stop) {
+		pthread_mutex_lock(&sim->lock);
+		sim_bench_poll(sim);
+		put = sim_cursor(sim_rd32(sim, SIM_FIFO_RXPUT(sim)),
+		  &sim->rxput_last);
+		avail = (put + sim->rxsz - sim->rxget) % sim->rxsz;
+		if (avail >= len) {
+			n = sim->rxsz - sim->rxget;
+			if (n > len) n = len;
+			memcpy(buf, &sim->regs[SIM_FIFO_RXDAT(sim) + sim->rxget],
+			  n);
+			memcpy(buf + n, &sim->regs[SIM_FIFO_RXDAT(sim)], len - n);
+			sim->rxget = (sim->rxget + len) % sim->rxsz;
+			sim_wr32(sim, SIM_FIFO_RXGET(sim), SIM_CURSOR(sim->rxget));
+			pthread_mutex_unlock(&sim->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&sim->lock);
+		sim_bench_idle();
+	}
+
+	return -1;
+}
+
+/* putc() or putc_noirq(), stalling on a full FIFO with flow control */
+static void sim_bench_putc(struct sim_fpga *sim, uint8_t c, int irq)
+{
+	uint16_t next = (sim->txput + 1) % sim->txsz;
+	uint16_t get;
+
+	while (!sim->bench_stop) {
+		pthread_mutex_lock(&sim->lock);
+		get = sim_cursor(sim_rd32(sim, SIM_FIFO_TXGET(sim)),
+		  &sim->txget_last);
+		if (next != get ||
+		  (sim->regs[SIM_FIFO_FLAGS(sim)] & (1 << 1))) {
+			sim->regs[SIM_FIFO_TXDAT(sim) + sim->txput] = c;
+			sim->txput = next;
+			sim_wr32(sim, SIM_FIFO_TXPUT(sim), SIM_CURSOR(next));
+			if (irq) sim_bench_tx_irq(sim);
+			pthread_mutex_unlock(&sim->lock);
+			return;
+		}
+		sim_bench_irq(sim);
+		pthread_mutex_unlock(&sim->lock);
+		sim_bench_idle();
+	}
+}
+
+/* fifo_write(), placing len bytes and raising the IRQ once, or not at all
+ * if coalesced */
+static void sim_bench_write(struct sim_fpga *sim, const uint8_t *buf,
+  unsigned long len)
+{
+	uint16_t get;
+	unsigned long n;
+
+	pthread_mutex_lock(&sim->lock);
+	while (len && !sim->bench_stop) {
+		if (!(sim->regs[SIM_FIFO_FLAGS(sim)] & (1 << 1))) {
+			get = sim_cursor(sim_rd32(sim, SIM_FIFO_TXGET(sim)),
+			  &sim->txget_last);
+			if (get > sim->txput) n = get - sim->txput - 1;
+			else n = sim->txsz - sim->txput + get - 1;
+			if (n == 0) {
+				sim_wr32(sim, SIM_FIFO_TXPUT(sim),
+				  SIM_CURSOR(sim->txput));
+				sim_bench_irq(sim);
+				pthread_mutex_unlock(&sim->lock);
+				sim_bench_idle();
+				pthread_mutex_lock(&sim->lock);
+				continue;
+			}
+			if (n > len) n = len;
+		} else {
+			n = len;
+		}
+		if (n > sim->txsz - sim->txput) n = sim->txsz - sim->txput;
+
+		memcpy(&sim->regs[SIM_FIFO_TXDAT(sim) + sim->txput], buf, n);
+		buf += n;
+		len -= n;
+		sim->txput = (sim->txput + n) % sim->txsz;
+	}
+	sim_wr32(sim, SIM_FIFO_TXPUT(sim), SIM_CURSOR(sim->txput));
+	sim_bench_tx_irq(sim);
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/* Returns the 32 bit big-endian count that follows an 'S' or 'O' command */
+static uint32_t sim_bench_count(struct sim_fpga *sim)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) n = (n << 8) | (sim_bench_getc(sim) & 0xff);
+
+	return n;
+}
+
+/* The main() of zpu/zpu_bench.c */
+static void *sim_bench_main(void *arg)
+{
+	struct sim_fpga *sim = arg;
+	uint32_t i, n;
+	int c;
+
+	while ((c = sim_bench_getc(sim)) != -1) {
+		switch (c) {
+		  case 'E':
+			n = sim_bench_getc(sim) & 0xff;
+			if (n == 0) n = 256;
+			for (i = 0; i < n; i++)
+				sim_bench_putc(sim, sim_bench_getc(sim), i == n - 1);
+			break;
+		  case 'S':
+			n = sim_bench_count(sim);
+			for (i = 0; i < n; i++) sim_bench_getc(sim);
+			sim_bench_putc(sim, 'S', 1);
+			break;
+		  case 'O':
+			n = sim_bench_count(sim);
+			for (i = 0; i < n; i++)
+				sim_bench_putc(sim, i & 0xff, i == n - 1);
+			break;
+		  default:
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* The main() of zpu/zpu_muxbus.c. Each command is taken whole from the RX
+ * FIFO. A write raises the IRQ when it is done, a read of count words returns
+ * them all from the one address in one fifo_write(). */
+static void *sim_muxbus_main(void *arg)
+{
+	struct sim_fpga *sim = arg;
+	uint8_t cmd[5], out[128];
+	uint16_t adr, dat;
+	int i, n;
+
+	while (sim_bench_read(sim, cmd, 1) == 0) {
+		if (sim_bench_read(sim, cmd + 1, (cmd[0] & 0x1) ? 2 : 4))
+			break;
+		adr = (cmd[1] << 8) | cmd[2];
+		if (cmd[0] & 0x1) {
+			n = ((cmd[0] >> 2) & 0x3f) + 1;
+			for (i = 0; i < n; i++) {
+				dat = sim->muxbus[adr];
+				out[i * 2] = dat >> 8;
+				out[i * 2 + 1] = dat & 0xff;
+			}
+			sim_bench_write(sim, out, n * 2);
+		} else {
+			pthread_mutex_lock(&sim->lock);
+			sim->muxbus[adr] = (cmd[3] << 8) | cmd[4];
+			sim_bench_irq(sim);
+			pthread_mutex_unlock(&sim->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Set up the FIFO struct as fifo_init() does, take the ZPU out of reset, and
+ * start the bench or MUXBUS peer.
+ */
+static int sim_bench_start(struct sim_fpga *sim)
+{
+	if (sim->txsz < 2 || sim->txsz > 0xfff || sim->rxsz < 2 ||
+	  sim->rxsz > 0xfff ||
+	  SIM_FIFO_COALESCE(sim) + 4 > SIM_ZPU_RAM + 0x2000) {
+		fprintf(stderr, "FPGA sim ZPU FIFO sizes are not valid\n");
+		errno = EINVAL;
+		return -1;
+	}
+	/* As zpu_muxbus.c, which takes each command from the RX FIFO whole */
+	if (sim->bench == SIM_PEER_MUXBUS && sim->rxsz < 5) {
+		fprintf(stderr, "FPGA sim ZPU MUXBUS needs an RX FIFO of 5\n");
+		errno = EINVAL;
+		return -1;
+	}
+
+	sim_wr32(sim, SIM_ZPU_RAM + 0x3c, SIM_ZPU_FIFO);
+	sim_wr32(sim, SIM_FIFO_COALESCE(sim), 0);
+	sim_wr32(sim, SIM_FIFO_FLAGS(sim), sim->txsz | sim->rxsz << 12 |
+	  (1 << 24) | (1 << 25));
+	sim->regs[SIM_ZPU_CTL_ADR] = 0;
+
+	errno = pthread_create(&sim->bench_thread, NULL,
+	  sim->bench == SIM_PEER_MUXBUS ? sim_muxbus_main : sim_bench_main, sim);
+	return errno ? -1 : 0;
+}
+
+/* ZPU emulator
+ *
+ * A ZPU that runs the real firmware image from ZPU RAM, so the firmware in
+ * zpu/ can be run end to end against the host tools, and its cost measured in
+ * ZPU clocks, without a TS-4100. It is the small ZPU: only the core
+ * instructions are done here, and the rest trap with EMULATE to the vectors
+ * that the crt0 of zpu-elf-gcc links at the start of every image, just as on
+ * hardware. The ZPU address map is:
+ *
+ *   0x0000-0x1FFF  RAM, the register file at 0x2000-0x3FFF
+ *   0x2000-0x2008  I_REG0-2, see below
+ *   0x2010-0x2018  OE_REG0-2, read/write
+ *   0x2020-0x2028  O_REG0-2, read/write
+ *   0x2030         TIMER_REG on read, IRQ0_REG on write
+ *   0x2034         IRQ1_REG, stored only as it is not on the modeled IRQ line
+ *
+ * Every other address reads as 0 and ignores writes. TIMER_REG counts the
+ * emulated clocks, rather than real time, so delays in the firmware take the
+ * same number of instructions as on hardware however fast the host runs.
+ *
+ * The clocks of each instruction are an estimate for the small ZPU, a fixed
+ * SIM_ZPU_CLK_INSN plus one for each word read or written, including the stack.
+ * This is enough to compare two builds of the same firmware.
+ *
+ * With nothing driving them, the inputs read back the outputs where the output
+ * is enabled, and 0 otherwise. A TS-8820 style MUXBUS device is decoded from
+ * the DIO that zpu/muxbus.c drives, with the same plain 16-bit registers
+ * behind it as the MUXBUS peer, so zpu_muxbus.bin works with tsmuxbusctl.
+ *
+ * The ZPU runs in its own thread, SIM_ZPU_SLICE instructions at a time under
+ * the sim lock, so that a word access by the ZPU is atomic to the CPU as on
+ * hardware.
+ */
+
+#define SIM_ZPU_RAM_SZ		0x2000
+/* Initial stack pointer of the small ZPU, the top of RAM */
+#define SIM_ZPU_SP		(SIM_ZPU_RAM_SZ - 8)
+#define SIM_ZPU_I_REG		0x2000
+#define SIM_ZPU_OE_REG		0x2010
+#define SIM_ZPU_O_REG		0x2020
+#define SIM_ZPU_TIMER		0x2030
+#define SIM_ZPU_IRQ0		0x2030
+#define SIM_ZPU_IRQ1		0x2034
+/* Where fifo_init() stores the address of the FIFO struct */
+#define SIM_ZPU_FIFO_PTR	0x3c
+/* Clocks for each instruction, before its memory accesses */
+#define SIM_ZPU_CLK_INSN	3
+/* Instructions run for each take of the sim lock */
+#define SIM_ZPU_SLICE		256
+/* Clocks the firmware is given to call fifo_init() on start, 1 s */
+#define SIM_ZPU_BOOT_CLKS	63000000ULL
+/* Status bit for the ZPU being in break */
+#define SIM_ZPU_BREAK		(1 << 2)
+
+/* MUXBUS DIO, as zpu/muxbus.h. AD is bits 31:27 of O_REG1 and 10:0 of O_REG2 */
+#define SIM_MB_ALEn		(1 << 26)
+#define SIM_MB_DIR		(1 << 25)
+#define SIM_MB_CSn		(1 << 24)
+
+/* Names of the EMULATE opcodes, by vector, for zpustats=1 */
+static const char *const sim_zpu_emulate_names[32] = {
+	[2] = "loadh", [3] = "storeh", [4] = "lessthan",
+	[5] = "lessthanorequal", [6] = "ulessthan", [7] = "ulessthanorequal",
+	[8] = "swap", [9] = "mult", [10] = "lshiftright", [11] = "ashiftleft",
+	[12] = "ashiftright", [13] = "call", [14] = "eq", [15] = "neq",
+	[16] = "neg", [17] = "sub", [18] = "xor", [19] = "loadb",
+	[20] = "storeb", [21] = "div", [22] = "mod", [23] = "eqbranch",
+	[24] = "neqbranch", [25] = "poppcrel", [26] = "config",
+	[27] = "pushpc", [28] = "syscall", [29] = "pushspadd",
+	[30] = "halfmult", [31] = "callpcrel",
+};
+
+/* The MUXBUS device, looking at the DIO each time O_REG1 is written. The
+ * address is latched as ALE# is deasserted, a read drives AD from CS#
+ * asserted until deasserted, and a write takes AD as CS# is deasserted. */
+static void sim_zpu_muxbus(struct sim_fpga *sim, uint32_t old)
+{
+	struct sim_zpu *z = &sim->zpu;
+	uint32_t o1 = z->o[1];
+	uint16_t ad = ((z->o[2] & 0x7ff) << 5) | (o1 >> 27);
+
+	if (!(old & SIM_MB_ALEn) && (o1 & SIM_MB_ALEn)) z->mb_adr = ad;
+	if ((old & SIM_MB_CSn) && !(o1 & SIM_MB_CSn))
+		z->mb_read = !!(o1 & SIM_MB_DIR);
+	if (!(old & SIM_MB_CSn) && (o1 & SIM_MB_CSn)) {
+		if (!(o1 & SIM_MB_DIR)) sim->muxbus[z->mb_adr] = ad;
+		z->mb_read = 0;
+	}
+}
+
+/* I_REG0-2, the outputs where enabled, else the MUXBUS device on AD during a
+ * read, else 0 */
+static uint32_t sim_zpu_in(struct sim_fpga *sim, int i)
+{
+	struct sim_zpu *z = &sim->zpu;
+	uint32_t in = 0;
+
+	if (z->mb_read && i == 1) in = (uint32_t)sim->muxbus[z->mb_adr] << 27;
+	if (z->mb_read && i == 2) in = (sim->muxbus[z->mb_adr] >> 5) & 0x7ff;
+
+	return (z->o[i] & z->oe[i]) | (in & ~z->oe[i]);
+}
+
+/* Word read and write in ZPU addressing. Called with the sim lock held. */
+static uint32_t sim_zpu_rd(struct sim_fpga *sim, uint32_t adr)
+{
+	struct sim_zpu *z = &sim->zpu;
+
+	z->cycles++;
+	adr &= ~3;
+	if (adr < SIM_ZPU_RAM_SZ) return sim_rd32(sim, SIM_ZPU_RAM + adr);
+	if (adr - SIM_ZPU_I_REG < 12)
+		return sim_zpu_in(sim, (adr - SIM_ZPU_I_REG) / 4);
+	if (adr - SIM_ZPU_OE_REG < 12) return z->oe[(adr - SIM_ZPU_OE_REG) / 4];
+	if (adr - SIM_ZPU_O_REG < 12) return z->o[(adr - SIM_ZPU_O_REG) / 4];
+	if (adr == SIM_ZPU_TIMER) return (uint32_t)z->cycles;
+	if (adr == SIM_ZPU_IRQ1) return z->irq1;
+
+	return 0;
+}
+
+static void sim_zpu_wr(struct sim_fpga *sim, uint32_t adr, uint32_t val)
+{
+	struct sim_zpu *z = &sim->zpu;
+	uint32_t old;
+
+	z->cycles++;
+	adr &= ~3;
+	if (adr < SIM_ZPU_RAM_SZ) {
+		sim_wr32(sim, SIM_ZPU_RAM + adr, val);
+		return;
+	}
+
+	if (adr - SIM_ZPU_OE_REG < 12) {
+		z->oe[(adr - SIM_ZPU_OE_REG) / 4] = val;
+	} else if (adr - SIM_ZPU_O_REG < 12) {
+		old = z->o[1];
+		z->o[(adr - SIM_ZPU_O_REG) / 4] = val;
+		if (adr == SIM_ZPU_O_REG + 4) sim_zpu_muxbus(sim, old);
+	} else if (adr == SIM_ZPU_IRQ0) {
+		/* The value is a ZPU address, which the CPU reads as an FPGA
+		 * address to clear the IRQ */
+		sim_irq_raise(sim, SIM_ZPU_RAM + (val & (SIM_ZPU_RAM_SZ - 1)));
+	} else if (adr == SIM_ZPU_IRQ1) {
+		z->irq1 = val;
+	}
+}
+
+static void sim_zpu_push(struct sim_fpga *sim, uint32_t val)
+{
+	sim->zpu.sp -= 4;
+	sim_zpu_wr(sim, sim->zpu.sp, val);
+}
+
+static uint32_t sim_zpu_pop(struct sim_fpga *sim)
+{
+	uint32_t val = sim_zpu_rd(sim, sim->zpu.sp);
+
+	sim->zpu.sp += 4;
+	return val;
+}
+
+static uint32_t sim_zpu_flip(uint32_t val)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 0; i < 32; i++, val >>= 1) r = (r << 1) | (val & 1);
+	return r;
+}
+
+/* Run one instruction. Returns 0, or -1 if the ZPU has stopped in break,
+ * either for a BREAKPOINT or an instruction the ZPU does not have. Called with
+ * the sim lock held.
+ */
+static int sim_zpu_step(struct sim_fpga *sim)
+{
+	struct sim_zpu *z = &sim->zpu;
+	uint32_t sp = z->sp, adr, val;
+	uint8_t op;
+	int idim = z->idim;
+
+	if (z->pc >= SIM_ZPU_RAM_SZ) goto brk;
+	op = sim->regs[SIM_ZPU_RAM + z->pc];
+	z->cycles += SIM_ZPU_CLK_INSN;
+	z->insns++;
+	z->idim = 0;
+
+	if (op & 0x80) {
+		/* IM, a run of them builds up 7 bits at a time */
+		if (idim) {
+			val = sim_zpu_rd(sim, sp);
+			sim_zpu_wr(sim, sp, (val << 7) | (op & 0x7f));
+		} else {
+			/* Sign extended */
+			val = (int32_t)((uint32_t)op << 25) >> 25;
+			sim_zpu_push(sim, val);
+		}
+		z->idim = 1;
+		z->pc++;
+		return 0;
+	}
+
+	switch (op & 0xe0) {
+	  case 0x60:
+		/* LOADSP, the offset has bit 4 inverted */
+		val = sim_zpu_rd(sim, sp + (((op & 0x1f) ^ 0x10) * 4));
+		sim_zpu_push(sim, val);
+		z->pc++;
+		return 0;
+	  case 0x40:
+		/* STORESP, relative to the SP before the pop */
+		adr = sp + (((op & 0x1f) ^ 0x10) * 4);
+		sim_zpu_wr(sim, adr, sim_zpu_pop(sim));
+		z->pc++;
+		return 0;
+	  case 0x20:
+		/* EMULATE, call the crt0 vector for the opcode */
+		z->emulated++;
+		z->traps[op & 0x1f]++;
+		sim_zpu_push(sim, z->pc + 1);
+		z->pc = (op & 0x1f) * 32;
+		return 0;
+	}
+
+	if ((op & 0xf0) == 0x10) {
+		/* ADDSP */
+		val = sim_zpu_rd(sim, sp + ((op & 0xf) * 4));
+		sim_zpu_wr(sim, sp, sim_zpu_rd(sim, sp) + val);
+		z->pc++;
+		return 0;
+	}
+
+	switch (op) {
+	  case 0x02: /* PUSHSP */
+		sim_zpu_push(sim, sp);
+		break;
+	  case 0x04: /* POPPC */
+		z->pc = sim_zpu_pop(sim);
+		return 0;
+	  case 0x05: /* ADD */
+		val = sim_zpu_pop(sim);
+		sim_zpu_wr(sim, z->sp, sim_zpu_rd(sim, z->sp) + val);
+		break;
+	  case 0x06: /* AND */
+		val = sim_zpu_pop(sim);
+		sim_zpu_wr(sim, z->sp, sim_zpu_rd(sim, z->sp) & val);
+		break;
+	  case 0x07: /* OR */
+		val = sim_zpu_pop(sim);
+		sim_zpu_wr(sim, z->sp, sim_zpu_rd(sim, z->sp) | val);
+		break;
+	  case 0x08: /* LOAD */
+		val = sim_zpu_rd(sim, sim_zpu_rd(sim, sp));
+		sim_zpu_wr(sim, sp, val);
+		break;
+	  case 0x09: /* NOT */
+		sim_zpu_wr(sim, sp, ~sim_zpu_rd(sim, sp));
+		break;
+	  case 0x0a: /* FLIP */
+		sim_zpu_wr(sim, sp, sim_zpu_flip(sim_zpu_rd(sim, sp)));
+		break;
+	  case 0x0b: /* NOP */
+		break;
+	  case 0x0c: /* STORE */
+		adr = sim_zpu_pop(sim);
+		sim_zpu_wr(sim, adr, sim_zpu_pop(sim));
+		break;
+	  case 0x0d: /* POPSP */
+		z->sp = sim_zpu_rd(sim, sp);
+		break;
+	  default: /* BREAKPOINT, or not an instruction */
+		goto brk;
+	}
+
+	z->pc++;
+	return 0;
+
+brk:
+	sim->regs[SIM_ZPU_STAT_ADR] |= SIM_ZPU_BREAK;
+	return -1;
+}
+
+/* Run up to n instructions, unless the ZPU is in reset or break. Returns the
+ * number run. Called with the sim lock held. */
+static int sim_zpu_run(struct sim_fpga *sim, int n)
+{
+	int i;
+
+	if ((sim->regs[SIM_ZPU_CTL_ADR] & 0x3) == 0x3 ||
+	  (sim->regs[SIM_ZPU_STAT_ADR] & SIM_ZPU_BREAK))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (sim_zpu_step(sim)) break;
+	}
+
+	return i;
+}
+
+/* Whether the firmware has set up its FIFO, as zpu_fifo_init() needs it: the
+ * pointer at 0x3c set, and the flags it points to giving both FIFO sizes.
+ * Called with the sim lock held. */
+static int sim_zpu_fifo_ready(struct sim_fpga *sim)
+{
+	uint32_t ptr, flags;
+
+	ptr = sim_rd32(sim, SIM_ZPU_RAM + SIM_ZPU_FIFO_PTR);
+	if (ptr == 0 || ptr > SIM_ZPU_RAM_SZ - 4) return 0;
+	flags = sim_rd32(sim, SIM_ZPU_RAM + ptr);
+
+	return (flags & 0xfff) && ((flags >> 12) & 0xfff);
+}
+
+/* Start the ZPU from reset, as when the CPU releases it through 19. On
+ * hardware, the firmware has long since called fifo_init() by the time a tool
+ * opens the FIFO, so it is run here until it does, or gives up or breaks, to
+ * save every tool from retrying. Called with the sim lock held.
+ */
+static void sim_zpu_reset(struct sim_fpga *sim)
+{
+	struct sim_zpu *z = &sim->zpu;
+	unsigned long long end = z->cycles + SIM_ZPU_BOOT_CLKS;
+
+	z->pc = 0;
+	z->sp = SIM_ZPU_SP;
+	z->idim = 0;
+	memset(z->oe, 0, sizeof(z->oe));
+	memset(z->o, 0, sizeof(z->o));
+	z->mb_read = 0;
+	sim->regs[SIM_ZPU_STAT_ADR] &= ~SIM_ZPU_BREAK;
+
+	while (!sim_zpu_fifo_ready(sim) && z->cycles < end) {
+		if (sim_zpu_run(sim, SIM_ZPU_SLICE) < SIM_ZPU_SLICE) break;
+	}
+}
+
+/* A write of the ZPU reset/control register by the CPU. Called with the sim
+ * lock held. */
+static void sim_zpu_ctl(struct sim_fpga *sim, uint8_t dat)
+{
+	int was_reset = (sim->regs[SIM_ZPU_CTL_ADR] & 0x3) == 0x3;
+
+	sim->regs[SIM_ZPU_CTL_ADR] = dat;
+	if (was_reset && (dat & 0x3) != 0x3) sim_zpu_reset(sim);
+}
+
+/* The emulated ZPU, running alongside the bus until the sim is closed */
+static void *sim_zpu_main(void *arg)
+{
+	struct sim_fpga *sim = arg;
+	int n;
+
+	while (!sim->bench_stop) {
+		pthread_mutex_lock(&sim->lock);
+		n = sim_zpu_run(sim, SIM_ZPU_SLICE);
+		pthread_mutex_unlock(&sim->lock);
+		/* Nothing to do while in reset or break until the CPU acts */
+		if (n) sim_bench_idle();
+		else usleep(1000);
+	}
+
+	return NULL;
+}
+
+/* Load zpubin= in to ZPU RAM and start it, then start the ZPU thread */
+static int sim_zpu_start(struct sim_fpga *sim)
+{
+	struct sim_zpu *z = &sim->zpu;
+	FILE *f;
+	size_t sz;
+	int err;
+
+	if (z->image) {
+		f = fopen(z->image, "rb");
+		if (f == NULL) {
+			err = errno;
+			fprintf(stderr, "FPGA sim ZPU image %s: %s\n", z->image,
+			  strerror(err));
+			errno = err;
+			return -1;
+		}
+		sz = fread(&sim->regs[SIM_ZPU_RAM], 1, SIM_ZPU_RAM_SZ, f);
+		if (sz == SIM_ZPU_RAM_SZ && fgetc(f) != EOF) {
+			fprintf(stderr, "FPGA sim ZPU image %s is over %d bytes\n",
+			  z->image, SIM_ZPU_RAM_SZ);
+			fclose(f);
+			errno = EFBIG;
+			return -1;
+		}
+		fclose(f);
+
+		pthread_mutex_lock(&sim->lock);
+		sim_zpu_ctl(sim, 0);
+		pthread_mutex_unlock(&sim->lock);
+	}
+
+	errno = pthread_create(&sim->bench_thread, NULL, sim_zpu_main, sim);
+	return errno ? -1 : 0;
+}
+
+/* zpustats=1, in the key=value form of the other stats */
+static void sim_zpu_stats(struct sim_fpga *sim, FILE *out)
+{
+	struct sim_zpu *z = &sim->zpu;
+	int i;
+
+	fprintf(out, "zpu_cycles=%llu\n", z->cycles);
+	fprintf(out, "zpu_instructions=%llu\n", z->insns);
+	fprintf(out, "zpu_emulated=%llu\n", z->emulated);
+	for (i = 0; i < 32; i++) {
+		if (z->traps[i] == 0) continue;
+		if (sim_zpu_emulate_names[i]) {
+			fprintf(out, "zpu_emulated_%s=%lu\n",
+			  sim_zpu_emulate_names[i], z->traps[i]);
+		} else {
+			fprintf(out, "zpu_emulated_%d=%lu\n", i + 32,
+			  z->traps[i]);
+		}
+	}
+	fprintf(out, "zpu_break=%d\n",
+	  !!(sim->regs[SIM_ZPU_STAT_ADR] & SIM_ZPU_BREAK));
+	fprintf(out, "zpu_pc=0x%x\n", z->pc);
+}
+
+static int sim_open(void **priv, const char *opts, uint8_t addr)
+{
+	struct sim_fpga *sim;
+	int ret = 0;
+
+	sim = calloc(1, sizeof(struct sim_fpga));
+	if (sim == NULL) return -1;
+
+	sim->regs[SIM_MODEL_ADR] = 0x41;
+	sim->regs[SIM_MODEL_ADR + 1] = 0x00;
+	sim->regs[SIM_REV_ADR] = 0xF;
+	sim->regs[SIM_SUB_ADR] = 0;
+	sim->regs[SIM_OPTS_ADR] = 0;
+	sim->regs[SIM_ZPU_CTL_ADR] = 0x3;
+	sim->nostart = 1;
+	sim->txsz = 256;
+	sim->rxsz = 16;
+
+	sim_parse_opts(sim, opts);
+
+	pthread_mutex_init(&sim->lock, NULL);
+	sim->irqfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sim->irqfd < 0) {
+		free(sim->zpu.image);
+		free(sim);
+		return -1;
+	}
+
+	if (sim->bench == SIM_PEER_EMU) ret = sim_zpu_start(sim);
+	else if (sim->bench) ret = sim_bench_start(sim);
+	if (ret) {
+		close(sim->irqfd);
+		free(sim->zpu.image);
+		free(sim);
+		return -1;
+	}
+
+	*priv = sim;
+	return 0;
+}
+
+static int sim_write(struct sim_fpga *sim, uint16_t adr, uint8_t dat)
+{
+	switch (adr) {
+	  case SIM_MODEL_ADR:
+	  case SIM_MODEL_ADR + 1:
+	  case SIM_REV_ADR:
+	  case SIM_SUB_ADR:
+	  case SIM_OPTS_ADR:
+		break;
+	  case SIM_ZPU_CTL_ADR:
+		if (sim->bench == SIM_PEER_EMU) sim_zpu_ctl(sim, dat);
+		else sim->regs[adr] = dat;
+		break;
+	  default:
+		sim->regs[adr] = dat;
+		break;
+	}
+
+	return 0;
+}
+
+static int sim_xfer(void *priv, struct i2c_msg *msgs, int nmsgs)
+{
+	struct sim_fpga *sim = priv;
+	unsigned long bytes = 0;
+	int i, j;
+
+	pthread_mutex_lock(&sim->lock);
+	for (i = 0; i < nmsgs; i++) {
+		/* Address byte for each start/repeated start */
+		bytes += 1 + msgs[i].len;
+
+		if (msgs[i].flags & I2C_M_RD) {
+			for (j = 0; j < msgs[i].len; j++) {
+				if (sim->ptr == sim->irq_adr) sim->irq = 0;
+				msgs[i].buf[j] = sim->regs[sim->ptr++];
+			}
+		} else if (msgs[i].flags & I2C_M_NOSTART) {
+			/* Continuation of the previous write, no address */
+			bytes--;
+			for (j = 0; j < msgs[i].len; j++)
+				sim_write(sim, sim->ptr++, msgs[i].buf[j]);
+		} else {
+			if (msgs[i].len < 2) {
+				pthread_mutex_unlock(&sim->lock);
+				errno = EINVAL;
+				return -1;
+			}
+			sim->ptr = ((uint8_t)msgs[i].buf[0] << 8) |
+			  (uint8_t)msgs[i].buf[1];
+			for (j = 2; j < msgs[i].len; j++)
+				sim_write(sim, sim->ptr++, msgs[i].buf[j]);
+		}
+	}
+	pthread_mutex_unlock(&sim->lock);
+
+	/* The ZPU runs alongside the bus, let the bench peer have its turn even
+	 * with a single CPU */
+	if (sim->bench) sched_yield();
+
+	sim_delay(sim->latency_ns + (bytes * sim->byte_ns));
+
+	return nmsgs;
+}
+
+static unsigned long sim_funcs(void *priv)
+{
+	struct sim_fpga *sim = priv;
+
+	return I2C_FUNC_I2C | (sim->nostart ? I2C_FUNC_NOSTART : 0);
+}
+
+static int sim_irq_fd(void *priv)
+{
+	struct sim_fpga *sim = priv;
+
+	return sim->irqfd;
+}
+
+static int sim_irq_level(void *priv)
+{
+	struct sim_fpga *sim = priv;
+
+	return sim->irq;
+}
+
+static int sim_close(void *priv)
+{
+	struct sim_fpga *sim = priv;
+
+	if (sim->bench) {
+		sim->bench_stop = 1;
+		pthread_join(sim->bench_thread, NULL);
+	}
+	if (sim->zpu.stats) sim_zpu_stats(sim, stderr);
+	free(sim->zpu.image);
+	close(sim->irqfd);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+	return 0;
+}
+
+const struct fpga_transport fpga_sim_transport = {
+	.name = "sim",
+	/* The same limit as i2c-dev, so chunking behaves as on hardware */
+	.max_len = 4096,
+	.open = sim_open,
+	.xfer = sim_xfer,
+	.funcs = sim_funcs,
+	.close = sim_close,
+	.irq_fd = sim_irq_fd,
+	.irq_level = sim_irq_level,
+};
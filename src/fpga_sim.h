@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef __FPGA_SIM_H_
+#define __FPGA_SIM_H_
+
+#include "fpga.h"
+
+/* Simulated TS-4100 FPGA register file, see fpga_sim.c */
+extern const struct fpga_transport fpga_sim_transport;
+
+#endif
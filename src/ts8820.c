@@ -66,17 +66,21 @@ int hw2sw[16] = {0, 4, 8, 12, 2, 6, 10, 14, 1, 5, 9, 13, 3, 7, 11, 15};
  * recommended.
  */
 
-int g_twifd;
+struct fpga_ctx *g_fpga;
+struct zpu_fifo *g_fifo;
 
-#define peek16(adr) zpu_muxbus_peek16(g_twifd, adr)
-#define peek16_stream(adr, dat, count) zpu_muxbus_peek16_stream(g_twifd, adr, dat, count)
-#define poke16(adr, val) zpu_muxbus_poke16(g_twifd, adr, val)
+#define peek16(adr) zpu_muxbus_peek16(g_fifo, adr)
+#define peek16_stream(adr, dat, count) zpu_muxbus_peek16_stream(g_fifo, adr, dat, count)
+#define poke16(adr, val) zpu_muxbus_poke16(g_fifo, adr, val)
 
-int ts8820_init(int twifd)
+int ts8820_init(struct fpga_ctx *fpga)
 {
-	g_twifd = twifd;
+	g_fpga = fpga;
 
-	if (zpu_fifo_init(g_twifd, 1) == -1) return 1;
+	/* Share the ZPU through tszpubroker if it is running */
+	g_fifo = zpu_broker_connect(NULL);
+	if (g_fifo == NULL) g_fifo = zpu_fifo_init(g_fpga, 1);
+	if (g_fifo == NULL) return 1;
 
         if (0 == (peek16(2) & 0xf)) {
                 fprintf(stderr, "Obsolete TS-8820 FPGA version!\n");
@@ -87,6 +91,11 @@ int ts8820_init(int twifd)
         else return 1;
 }
 
+void ts8820_stats_print(FILE *f)
+{
+	if (g_fifo != NULL) zpu_fifo_stats_print(g_fifo, f);
+}
+
 int ts8820_adc_acq(int hz, int n, unsigned short mask) {
         unsigned short buf[0x8000];
         unsigned short fifo_buf[64], *fifo_buf_p;;
@@ -22,10 +22,18 @@
  * memory mapped.
  */
 
+#include <stdio.h>
+
+struct fpga_ctx;
+
 /* Call this function once before using the other ts8820 functions.
  * See ts8820ctl.c for an example of usage.
  */
-int ts8820_init(int twifd);
+int ts8820_init(struct fpga_ctx *fpga);
+
+/* Prints how the ZPU MUXBUS operations completed, see zpu_fifo_stats_print()
+ */
+void ts8820_stats_print(FILE *f);
 
 /* int ts8820_adc_acq(int hz, int n, unsigned short mask)
  * Samples ADCs n times at hz Hz and sends raw data to stdout.  Only channels
@@ -17,7 +17,14 @@
 #include "ts8820.h"
 #include "fpga.h"
 
-static int twifd;
+static struct fpga_ctx *fpga;
+
+/* With --stats, bus and ZPU wait statistics are printed to stderr on exit */
+static void print_stats(void)
+{
+	if (fpga != NULL) fpga_stats_print(fpga, stderr);
+	ts8820_stats_print(stderr);
+}
 
 const char copyright[] = "Copyright (c) embeddedTS - " __DATE__ " - "
   GITCOMMIT;
@@ -37,6 +44,9 @@ int get_model()
 	char mdl[256];
 	char *ptr;
 
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
 	proc = fopen("/proc/device-tree/model", "r");
 	if (!proc) {
 		perror("model");
@@ -58,7 +68,9 @@ static void usage(char **argv) {
 	  "  -R, --read             Read 16-bit register at <addr>\n"
 	  "  -W, --write=<val>      Write 16-bit <val> to register at <addr>\n"
 	  "  -A, --address=<addr>   TS-8820 FPGA address to read or write\n"
+	  "      --stats            Print FPGA bus and ZPU statistics on exit\n"
 	  "  -h, --help             This help\n\n"
+	  "  The ZPU is shared through tszpubroker when it is running.\n\n"
 
 	  " ADC Options:\n"
 	  "  -s, --sample=<num>     Print <num> samples per ADC channel in mV\n"
@@ -115,6 +127,7 @@ int main(int argc, char **argv) {
 	int c;
 	int model;
 	int opt_address = -1, opt_read = 0, opt_write = 0, opt_writearg = 0;
+	int opt_stats = 0;
 	/* ADC specific */
 	int opt_sample = 0, opt_acquire = 0;
 	int opt_rate = 10000, opt_mask = 0xffff;
@@ -164,6 +177,7 @@ int main(int argc, char **argv) {
 	  { "read",	no_argument,		0, 'R' },
 	  { "write",	required_argument,	0, 'W' },
 	  { "address",	required_argument,	0, 'A' },
+	  { "stats",	no_argument,		0, 'S' },
 	  { "help",	no_argument,		0, 'h' },
 	  { 0,		0,			0,  0 }
 	};
@@ -260,6 +274,9 @@ int main(int argc, char **argv) {
 		  case 'A': /* Gen. Address to read/write */
 			opt_address = strtoul(optarg, NULL, 0);
 			break;
+		  case 'S': /* FPGA bus statistics */
+			opt_stats = 1;
+			break;
 		  case 'h':
 		  default:
 			usage(argv);
@@ -273,13 +290,18 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	twifd = fpga_init("/dev/i2c-2", 0x28);
-	if(twifd == -1) {
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
 		perror("Can't open FPGA I2C bus");
 		return 1;
 	}
 
-	if (ts8820_init(twifd)) {
+	if (opt_stats) {
+		fpga_stats_enable(fpga);
+		atexit(print_stats);
+	}
+
+	if (ts8820_init(fpga)) {
 		printf("TS-8820 not detected.\n");
 		return 1;
 	}
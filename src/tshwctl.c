@@ -2,19 +2,29 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "eval_cmdline.h"
 #include "fpga.h"
+#include "fpga_async.h"
 
 const char copyright[] = "Copyright (c) embeddedTS - " __DATE__ " - "
   GITCOMMIT;
 
-static int twifd;
+static struct fpga_ctx *fpga;
+
+/* With --stats, FPGA bus statistics are printed to stderr on exit */
+static void print_stats(void)
+{
+	if (fpga != NULL) fpga_stats_print(fpga, stderr);
+}
 
 int get_model()
 {
@@ -22,6 +32,9 @@ int get_model()
 	char mdl[256];
 	char *ptr;
 
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
 	proc = fopen("/proc/device-tree/model", "r");
 	if (!proc) {
 		perror("model");
@@ -32,6 +45,282 @@ int get_model()
 	return strtoul(ptr+3, NULL, 16);
 }
 
+/* Batch mode
+ *
+ * Commands are read one per line from a file, or from stdin if the file is
+ * "-", and run against a single open FPGA:
+ *
+ *   peek <addr> [count]          Read count (default 1) registers
+ *   poke <addr> <val> [val ...]  Write successive registers
+ *   route <out> <in>             Same as -o <out> -j <in>
+ *
+ * Blank lines and anything following a '#' are ignored. Consecutive peeks,
+ * or consecutive pokes, of adjacent addresses are merged in to one streamed
+ * access, and accesses are queued to the FPGA bus-owner thread which packs
+ * as many as possible in to each I2C transaction. Every register read is
+ * printed on its own line as "<addr>=<value>", in command order.
+ */
+#define BATCH_DEPTH	64
+
+struct batch {
+	struct fpga_ctx *fpga;
+	struct fpga_async *q;
+	struct fpga_req *pending;
+	sem_t slots;
+	/* Set by the FPGA worker as well as the parser, so always accessed
+	 * with the __atomic builtins until the worker has stopped */
+	int failed;
+};
+
+/* Completion callback, runs on the FPGA worker thread in submission order
+ * Not intended to be called directly
+ */
+static void batch_done(struct fpga_req *req, void *arg)
+{
+	struct batch *b = arg;
+	int i;
+
+	if (req->status) {
+		fprintf(stderr, "Unable to %s 0x%X\n",
+		  req->op == FPGA_REQ_PEEK ? "peek" : "poke", req->addr);
+		__atomic_store_n(&b->failed, 1, __ATOMIC_RELEASE);
+	} else if (req->op == FPGA_REQ_PEEK) {
+		for (i = 0; i < req->size; i++)
+			printf("0x%X=0x%X\n", req->addr + i, req->data[i]);
+		fflush(stdout);
+	}
+
+	free(req);
+	sem_post(&b->slots);
+}
+
+/* Queue the pending access, waiting for room in the queue if needed. The
+ * batch may run for as long as stdin is open, while other processes reset
+ * the ZPU, so nothing cached is trusted across accesses.
+ * Not intended to be called directly
+ */
+static int batch_flush(struct batch *b)
+{
+	if (b->pending == NULL) return 0;
+
+	fpga_cache_invalidate(b->fpga);
+
+	while (sem_wait(&b->slots) && errno == EINTR);
+	if (fpga_async_submit(b->q, b->pending)) {
+		perror("Unable to queue FPGA access");
+		free(b->pending);
+		b->pending = NULL;
+		sem_post(&b->slots);
+		return 1;
+	}
+	b->pending = NULL;
+
+	return 0;
+}
+
+/* Add one register to the pending access if it continues it, otherwise
+ * queue the pending access and start a new one.
+ * Not intended to be called directly
+ */
+static int batch_add(struct batch *b, enum fpga_req_op op, uint16_t addr,
+  uint8_t val)
+{
+	struct fpga_req *req = b->pending;
+
+	if (req != NULL && (req->op != op || req->size == FPGA_MAX_CHUNK ||
+	  req->addr + req->size != addr)) {
+		if (batch_flush(b)) return 1;
+		req = NULL;
+	}
+
+	if (req == NULL) {
+		req = calloc(1, sizeof(struct fpga_req) + FPGA_MAX_CHUNK);
+		if (req == NULL) {
+			perror("Unable to allocate FPGA access");
+			return 1;
+		}
+		req->op = op;
+		req->addr = addr;
+		req->data = (uint8_t *)(req + 1);
+		req->done = batch_done;
+		req->arg = b;
+		b->pending = req;
+	}
+	req->data[req->size++] = val;
+
+	return 0;
+}
+
+/* Parse a number argument, returns 1 if it is missing or malformed
+ * Not intended to be called directly
+ */
+static int batch_num(char *arg, unsigned long max, unsigned long *val)
+{
+	char *end;
+
+	if (arg == NULL) return 1;
+	*val = strtoul(arg, &end, 0);
+
+	return (*end != '\0' || *val > max);
+}
+
+/* Run every command in path, "-" is stdin.
+ *
+ * Returns 0 on success, 1 if any command could not be parsed or failed.
+ */
+static int batch_run(struct fpga_ctx *fpga, const char *path)
+{
+	struct batch b = { 0 };
+	unsigned long addr = 0, val = 0, cnt = 0;
+	char line[1024], *cmd, *arg, *hash;
+	FILE *f;
+	int lineno = 0, err;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	b.fpga = fpga;
+	b.q = fpga_async_start(fpga, BATCH_DEPTH);
+	if (b.q == NULL) {
+		if (f != stdin) fclose(f);
+		return 1;
+	}
+	sem_init(&b.slots, 0, BATCH_DEPTH);
+
+	while (!__atomic_load_n(&b.failed, __ATOMIC_ACQUIRE) &&
+	  fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		hash = strchr(line, '#');
+		if (hash) *hash = '\0';
+
+		cmd = strtok(line, " \t\r\n");
+		if (cmd == NULL) continue;
+
+		err = batch_num(strtok(NULL, " \t\r\n"), 0xFFFF, &addr);
+		if (!strcmp(cmd, "peek")) {
+			arg = strtok(NULL, " \t\r\n");
+			cnt = 1;
+			if (!err && arg != NULL)
+				err = batch_num(arg, 0x10000 - addr, &cnt);
+			while (!err && cnt--)
+				err = batch_add(&b, FPGA_REQ_PEEK, addr++, 0);
+		} else if (!strcmp(cmd, "poke")) {
+			arg = strtok(NULL, " \t\r\n");
+			if (arg == NULL) err = 1;
+			for (; !err && arg != NULL;
+			  arg = strtok(NULL, " \t\r\n")) {
+				/* As peek, no running past 0xFFFF */
+				err = batch_num(arg, 0xFF, &val) ||
+				  addr > 0xFFFF;
+				if (!err)
+					err = batch_add(&b, FPGA_REQ_POKE,
+					  addr++, val);
+			}
+		} else if (!strcmp(cmd, "route")) {
+			/* Same sequence as -o/-j, see main() */
+			err |= batch_num(strtok(NULL, " \t\r\n"), 0x7F, &val);
+			if (!err) err = addr > 0x7F;
+			if (!err) err = batch_add(&b, FPGA_REQ_POKE,
+			  0x80 + addr, val);
+			if (!err) err = batch_add(&b, FPGA_REQ_POKE, addr, 0x1);
+			if (!err) err = batch_add(&b, FPGA_REQ_POKE, val, 0x0);
+			if (!err) err = batch_add(&b, FPGA_REQ_PEEK,
+			  0x80 + addr, 0);
+		} else {
+			err = 1;
+		}
+
+		if (err) {
+			fprintf(stderr, "%s:%d: invalid command\n", path,
+			  lineno);
+			__atomic_store_n(&b.failed, 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	batch_flush(&b);
+	fpga_async_stop(b.q);
+	sem_destroy(&b.slots);
+	free(b.pending);
+	if (f != stdin) fclose(f);
+
+	return b.failed;
+}
+
+/* Watch mode
+ *
+ * The whole range is read with a single streamed access each pass, and only
+ * registers whose value differs from the last pass are printed, as
+ * "<seconds>.<microseconds> <addr>=<value>" using the wall clock time the
+ * pass was started. Every register is printed on the first pass. Passes start
+ * every interval_us microseconds, or back to back if it is 0, until SIGINT or
+ * SIGTERM. The range is marked volatile so it is never served from the
+ * register cache.
+ */
+static volatile sig_atomic_t watch_term;
+static void watch_sig(int x)
+{
+	watch_term = 1;
+}
+
+static int watch_run(struct fpga_ctx *fpga, uint16_t start, size_t len,
+  unsigned long interval_us)
+{
+	struct timespec next, now;
+	uint8_t *cur, *last;
+	size_t i;
+	int first = 1, ret = 0;
+
+	cur = malloc(len);
+	last = malloc(len);
+	if (cur == NULL || last == NULL) {
+		perror("Unable to allocate watch buffers");
+		free(cur);
+		free(last);
+		return 1;
+	}
+
+	fpga_cache_set(fpga, start, len, 0);
+	signal(SIGINT, watch_sig);
+	signal(SIGTERM, watch_sig);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!watch_term) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (fpga_read_range(fpga, start, cur, len)) {
+			ret = 1;
+			break;
+		}
+
+		for (i = 0; i < len; i++) {
+			if (!first && cur[i] == last[i]) continue;
+			printf("%ld.%06ld 0x%X=0x%X\n", (long)now.tv_sec,
+			  now.tv_nsec / 1000, (unsigned int)(start + i), cur[i]);
+		}
+		fflush(stdout);
+		memcpy(last, cur, len);
+		first = 0;
+
+		if (interval_us) {
+			next.tv_sec += interval_us / 1000000;
+			next.tv_nsec += (interval_us % 1000000) * 1000;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+			  NULL);
+		}
+	}
+
+	free(cur);
+	free(last);
+
+	return ret;
+}
+
 void usage(char **argv) {
 	fprintf(stderr,
 	  "%s\n\n"
@@ -46,6 +335,14 @@ void usage(char **argv) {
 	  "  -j, --in <I/O>         FPGA input that will be routed to "
 	    "the output\n"
 	  "  -i, --info             Print information about the device\n"
+	  "  -b, --batch <file>     Run peek/poke/route commands from file, "
+	    "or - for stdin\n"
+	  "  -W, --watch <start:len>  Print registers in the range as they "
+	    "change\n"
+	  "  -t, --interval <us>    Time between --watch reads, 0 for as fast "
+	    "as possible\n"
+	  "                           (default 100000)\n"
+	  "      --stats            Print FPGA bus statistics on exit\n"
 	  "  -h, --help             This message\n"
 	  "\n",
 	  copyright, argv[0]
@@ -56,12 +353,16 @@ int main(int argc, char **argv)
 {
 	int c;
 	uint16_t model;
-	uint8_t rev, tmp[3];
+	uint8_t rev, tmp[5];
 	uint16_t addr = 0x0;
 	int opt_addr = 0, opt_poke = 0, opt_peek = 0;;
 	uint8_t pokeval = 0;
-	int opt_info = 0;
+	int opt_info = 0, opt_stats = 0;
 	int opt_input = -1, opt_output = -1;
+	char *opt_batch = NULL;
+	char *opt_watch = NULL, *end;
+	unsigned long watch_start = 0, watch_len = 0;
+	unsigned long opt_interval = 100000;
 
 	static struct option long_options[] = {
 	  { "address", required_argument, NULL, 'a' },
@@ -70,6 +371,10 @@ int main(int argc, char **argv)
 	  { "out",     required_argument, NULL, 'o' },
 	  { "in",      required_argument, NULL, 'j' },
 	  { "info",    no_argument,       NULL, 'i' },
+	  { "batch",   required_argument, NULL, 'b' },
+	  { "watch",   required_argument, NULL, 'W' },
+	  { "interval",required_argument, NULL, 't' },
+	  { "stats",   no_argument,       NULL, 'S' },
 	  { "help",    no_argument,       NULL, 'h' },
 	  { NULL,      no_argument,       NULL,  0  }
 	};
@@ -80,7 +385,7 @@ int main(int argc, char **argv)
 	}
 
 	while((c = getopt_long(argc, argv,
-	  "a:rw:cgsqj:o:ih",
+	  "a:rw:cgsqj:o:ib:W:t:h",
 	  long_options, NULL)) != -1) {
 		switch(c) {
 		  case 'a': /* FPGA address */
@@ -103,12 +408,34 @@ int main(int argc, char **argv)
 		  case 'i': /* Info */
 			opt_info = 1;
 			break;
+		  case 'b': /* Batch commands */
+			opt_batch = optarg;
+			break;
+		  case 'W': /* Watch range */
+			opt_watch = optarg;
+			break;
+		  case 't': /* Watch interval */
+			opt_interval = strtoul(optarg, NULL, 0);
+			break;
+		  case 'S': /* Bus statistics */
+			opt_stats = 1;
+			break;
 		  case 'h':
 		  default:
 			usage(argv);
 		}
 	}
 
+	if (opt_watch) {
+		watch_start = strtoul(opt_watch, &end, 0);
+		if (*end == ':') watch_len = strtoul(end + 1, &end, 0);
+		if (*end != '\0' || watch_len == 0 || watch_start > 0xFFFF ||
+		  watch_len > 0x10000 - watch_start) {
+			fprintf(stderr, "Watch range must be <start>:<len>\n");
+			return 1;
+		}
+	}
+
 	/* While it would be nice and is possible to check the FPGA for the
 	 * model, we need to know if we are on the correct platform to access
 	 * the FPGA to get the model. So, this still relies on the /proc method.
@@ -122,32 +449,45 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	twifd = fpga_init("/dev/i2c-2", 0x28);
+	fpga = fpga_init("/dev/i2c-2", 0x28);
 
-	if(twifd == -1) {
+	if(fpga == NULL) {
 		perror("Can't open FPGA I2C bus");
 		return 1;
 	}
 
+	if (opt_stats) {
+		fpga_stats_enable(fpga);
+		atexit(print_stats);
+	}
+
+	if (opt_batch && batch_run(fpga, opt_batch)) return 1;
+
 	if (opt_peek || opt_poke) {
 		if (!opt_addr) {
 			fprintf(stderr, "Address must be specified\n");
 			return 1;
 		}
 
-		if (opt_poke) fpoke8(twifd, addr, pokeval);
-		if (opt_peek) printf("0x%X\n", fpeek8(twifd, addr));
+		if (opt_poke) fpoke8(fpga, addr, pokeval);
+		if (opt_peek) printf("0x%X\n", fpeek8(fpga, addr));
 	}
 
 	if (opt_input >= 0 && opt_output >= 0) {
-		fpoke8(twifd, 0x80 + opt_output, (uint8_t)opt_input);
+		struct fpga_xfer xfer;
+		uint8_t route;
+
+		fpga_xfer_begin(&xfer, fpga);
+		fpga_xfer_poke8(&xfer, 0x80 + opt_output, (uint8_t)opt_input);
 		/* Set the output and input bits. Set the output side to low as
 		 * the FPGA inits the registers to be 0 anyway for the output
 		 * direction.
 		 */
-		fpoke8(twifd, opt_output, 0x1);
-		fpoke8(twifd, opt_input, 0x0);
-		printf("0x%X\n", fpeek8(twifd, 0x80 + opt_output));
+		fpga_xfer_poke8(&xfer, opt_output, 0x1);
+		fpga_xfer_poke8(&xfer, opt_input, 0x0);
+		fpga_xfer_peek8(&xfer, 0x80 + opt_output, &route);
+		if (fpga_xfer_commit(&xfer)) return 1;
+		printf("0x%X\n", route);
 	} else if (opt_input >= 0 || opt_output >= 0) {
 		fprintf(stderr, "Both input and output must be specified\n");
 		return 1;
@@ -155,18 +495,24 @@ int main(int argc, char **argv)
 
 	if(opt_info) {
 		eval_cmd_init();
-		fpeekstream8(twifd, tmp, 304, 3);
+		/* Model, rev, and opts are contiguous, grab them all at once */
+		fpeekstream8(fpga, tmp, 304, 5);
 		model = tmp[1] | (tmp[0] << 8);
 		rev = tmp[2];
 
 		printf("model=0x%X\n", model);
 		printf("fpgarev=%d\n", rev);
-		printf("opts=0x%X\n", fpeek8(twifd, 308) & 0x1F);
+		printf("opts=0x%X\n", tmp[4] & 0x1F);
 		printf("bbid=0x%X\n", eval_cmd("bbid"));
 		printf("bbrev=0x%X\n", eval_cmd("bbrev"));
 	}
 
-	close(twifd);
+	if (opt_watch &&
+	  watch_run(fpga, watch_start, watch_len, opt_interval)) return 1;
+
+	if (opt_stats) print_stats();
+	fpga_deinit(fpga);
+	fpga = NULL;
 
 	return 0;
 }
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "tszpufifo.h"
 #include "fpga.h"
@@ -22,6 +23,9 @@ int get_model()
 	char mdl[256];
 	char *ptr;
 
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
 	proc = fopen("/proc/device-tree/model", "r");
 	if (!proc) {
 		perror("model");
@@ -37,6 +41,7 @@ static void usage(char **argv) {
 	fprintf(stderr,
 	  "%s\n\n"
 	  "Usage: %s ADDRESS [VALUE]\n"
+	  "       %s --irq-bench COUNT [ADDRESS]\n"
 	  "embeddedTS ZPU MUXBUS demo tool\n\n"
 
 	  "  ADDRESS     The MUXBUS address to read/write 16-bit value\n"
@@ -46,17 +51,132 @@ static void usage(char **argv) {
 	  "ADDRESS. On a write, VALUE is written to ADDRESS, and then read\n"
 	  "back. The resulting read is printed.\n\n"
 
+	  "If tszpubroker is running, the ZPU is accessed through it rather\n"
+	  "than directly, using the socket in ZPU_BROKER if that is set.\n"
+	  "The IRQ bench always uses the ZPU directly, so must not be run\n"
+	  "alongside tszpubroker.\n\n"
+
+	  "With --irq-bench, COUNT reads of ADDRESS (default 0) are timed and\n"
+	  "the latency from each request to the ZPU IRQ waking this process,\n"
+	  "and with libgpiod, from the kernel timestamp of the IRQ edge to the\n"
+	  "wakeup, is printed. Set ZPU_IRQ_SYSFS=1 to compare with the sysfs\n"
+	  "GPIO IRQ.\n"
+	  "The same reads are then timed through the MUXBUS calls, which poll\n"
+	  "for short operations before falling back to the IRQ, along with\n"
+	  "how many completed each way.\n\n"
+
 	  "Returns 0 on success, 1 on any error.\n\n",
-	  copyright, argv[0]
+	  copyright, argv[0], argv[0]
 	);
 }
 
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static long long ts_ns(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Print min/avg/p50/p99/max of n samples in microseconds */
+static void print_lat(const char *name, long long *ns, int n)
+{
+	long long sum = 0;
+	int i;
+
+	qsort(ns, n, sizeof(long long), cmp_ll);
+	for (i = 0; i < n; i++) sum += ns[i];
+	printf("%s_min_us=%.1f\n", name, ns[0] / 1000.0);
+	printf("%s_avg_us=%.1f\n", name, sum / n / 1000.0);
+	printf("%s_p50_us=%.1f\n", name, ns[n / 2] / 1000.0);
+	printf("%s_p99_us=%.1f\n", name, ns[(n * 99) / 100] / 1000.0);
+	printf("%s_max_us=%.1f\n", name, ns[n - 1] / 1000.0);
+}
+
+/* IRQ latency benchmark
+ *
+ * Each pass sends a MUXBUS 16-bit read request and blocks on the ZPU IRQ
+ * that signals the reply is ready. Timed are the full request to wakeup
+ * time, and the time from the kernel's timestamp of the IRQ edge to this
+ * process running again. Only libgpiod timestamps the edge, so the second is
+ * left out on any other IRQ path.
+ */
+static int irq_bench(struct zpu_fifo *zf, int count, uint16_t addr)
+{
+	struct timespec t0, t1, edge;
+	long long *rtt, *wake, *hyb;
+	const char *path = zpu_fifo_irq_name(zf);
+	uint8_t buf[3];
+	int i, ret = 1;
+
+	rtt = calloc(count, sizeof(long long));
+	wake = calloc(count, sizeof(long long));
+	hyb = calloc(count, sizeof(long long));
+	if (rtt == NULL || wake == NULL || hyb == NULL) {
+		perror("Unable to allocate samples");
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* MUXBUS 16-bit read, see zpu_muxbus_peek16() */
+		buf[0] = 0x3;
+		buf[1] = (addr >> 8) & 0xFF;
+		buf[2] = (addr & 0xFF);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		zpu_fifo_put(zf, buf, 3);
+		if (zpu_fifo_irq_wait(zf, &edge)) {
+			perror("Unable to wait for ZPU IRQ");
+			goto out;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		zpu_fifo_get(zf, buf, 2);
+
+		rtt[i] = ts_ns(&t1) - ts_ns(&t0);
+		wake[i] = ts_ns(&t1) - ts_ns(&edge);
+	}
+
+	/* The same through the hybrid poll/IRQ wait of the MUXBUS calls */
+	for (i = 0; i < count; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		zpu_muxbus_peek16(zf, addr);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		hyb[i] = ts_ns(&t1) - ts_ns(&t0);
+	}
+
+	printf("irq_path=%s\n", path);
+	printf("count=%d\n", count);
+	print_lat("request_to_wakeup", rtt, count);
+	if (!strcmp(path, "gpiod")) print_lat("irq_to_wakeup", wake, count);
+	print_lat("hybrid_request_to_done", hyb, count);
+	zpu_fifo_stats_print(zf, stdout);
+	ret = 0;
+
+out:
+	free(rtt);
+	free(wake);
+	free(hyb);
+
+	return ret;
+}
+
 int main(int argc, char **argv) {
-	int twifd;
-	int model;
+	struct fpga_ctx *fpga;
+	struct zpu_fifo *zf;
+	int model, ret, bench = 0;
 	uint16_t addr, val;
 
-	if ((argc == 1) || (argc > 3) || !strncmp(argv[1], "-h", 2) ||
+	if (argc >= 3 && !strcmp(argv[1], "--irq-bench")) {
+		bench = atoi(argv[2]);
+		if (argc > 4 || bench < 1) {
+			usage(argv);
+			return 1;
+		}
+	} else if ((argc == 1) || (argc > 3) || !strncmp(argv[1], "-h", 2) ||
 	  !strncmp(argv[1], "--help", 6)) {
 		usage(argv);
 		return 1;
@@ -69,29 +189,40 @@ int main(int argc, char **argv) {
 	}
 
 
-	twifd = fpga_init("/dev/i2c-2", 0x28);
-	if(twifd == -1) {
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
 		/* fpga_init() calls open() which fails with errno set */
 		perror("Can't open FPGA I2C bus");
 		return 1;
 	}
 
-	/* zpu_fifo_init() also returns irqfd, we don't need to worry about that
-	 * unless wanted. The irqfd is maintained by tszpufifo ctx */
-        if (zpu_fifo_init(twifd, FLOW_CTRL) == -1) return 1;
+	/* Share the ZPU through tszpubroker if it is running. The IRQ bench
+	 * needs the FIFO itself, the IRQ fd is kept in the FIFO handle, see
+	 * zpu_fifo_fd() */
+	zf = bench ? NULL : zpu_broker_connect(NULL);
+	if (zf == NULL) zf = zpu_fifo_init(fpga, FLOW_CTRL);
+	if (zf == NULL) return 1;
+
+	if (bench) {
+		addr = argc == 4 ? (uint16_t)strtoul(argv[3], NULL, 0) : 0;
+		ret = irq_bench(zf, bench, addr);
+		zpu_fifo_deinit(zf);
+		fpga_deinit(fpga);
+		return ret;
+	}
 
 	addr = (uint16_t)strtoul(argv[1], NULL, 0);
 
 	/* If VALUE was passed, write that first */
 	if (argc == 3) {
 		val = (uint16_t)strtoul(argv[2], NULL, 0);
-		zpu_muxbus_poke16(twifd, addr, val);
+		zpu_muxbus_poke16(zf, addr, val);
 	}
 
-	printf("0x%04X\n", zpu_muxbus_peek16(twifd, addr));
+	printf("0x%04X\n", zpu_muxbus_peek16(zf, addr));
 
-	zpu_fifo_deinit(twifd);
-	fpga_deinit(twifd);
+	zpu_fifo_deinit(zf);
+	fpga_deinit(fpga);
 
 	return 0;
 }
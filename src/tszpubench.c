@@ -0,0 +1,349 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* ZPU FIFO benchmark
+ *
+ * Measures the CPU to ZPU FIFO link against the zpu/zpu_bench.c application
+ * running in the ZPU, or against the simulated FPGA with its native copy of
+ * that application, e.g.
+ *
+ *   FPGA_BUS=sim:zpu=bench,khz=400 tszpubench
+ *
+ * Results are printed as key=value lines so runs can be compared.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fpga.h"
+#include "tszpufifo.h"
+
+const char copyright[] = "Copyright (c) embeddedTS - " __DATE__ " - "
+  GITCOMMIT;
+
+/* Give up on any single bench operation after this long */
+#define BENCH_TIMEOUT_MS	2000
+/* With flow control off, a source run ends when no data arrives for this long,
+ * as overrun bytes never arrive */
+#define BENCH_IDLE_MS		100
+/* Largest echo, one 'E' command */
+#define BENCH_ECHO_MAX		256
+/* Default bulk transfer size. A prime, so with flow control off it is never a
+ * whole number of laps of the TX FIFO, which an overrun could lose entirely */
+#define BENCH_BYTES		65521
+
+int get_model()
+{
+	FILE *proc;
+	char mdl[256];
+	char *ptr;
+
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
+	proc = fopen("/proc/device-tree/model", "r");
+	if (!proc) {
+		perror("model");
+		return 0;
+	}
+	fread(mdl, 256, 1, proc);
+	ptr = strstr(mdl, "TS-");
+	return strtoull(ptr+3, NULL, 16);
+}
+
+static void usage(char **argv) {
+	fprintf(stderr,
+	  "%s\n\n"
+	  "Usage: %s [OPTIONS] ...\n"
+	  "embeddedTS ZPU FIFO benchmark\n"
+	  "\n"
+	  "  -b, --bytes <n>      Bytes moved in each bulk test, default 65521\n"
+	  "  -n, --count <n>      Round trips for each echo size, default 200\n"
+	  "  -f, --flow <mode>    Flow control \"on\", \"off\", or \"both\",\n"
+	  "                         default both\n"
+	  "  -h, --help           This message\n"
+	  "\n"
+	  "The zpu_bench application must be running in the ZPU, or the\n"
+	  "simulated FPGA used with FPGA_BUS=sim:zpu=bench.\n"
+	  "\n"
+	  "For each flow control mode, prints the bytes per second of bulk\n"
+	  "transfers to the ZPU (sink) and from the ZPU (source), and the\n"
+	  "p50/p99/max round trip time of 1 to 256 byte echoes. With flow\n"
+	  "control off, bytes the ZPU overran are counted as lost rather than\n"
+	  "as errors.\n"
+	  "\n",
+	  copyright, argv[0]
+	);
+}
+
+static long long ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_ns(&ts);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Send a command and its 32-bit count */
+static int send_cmd(struct zpu_fifo *zf, uint8_t cmd, uint32_t n)
+{
+	struct timespec deadline;
+	uint8_t buf[5];
+
+	buf[0] = cmd;
+	buf[1] = n >> 24;
+	buf[2] = n >> 16;
+	buf[3] = n >> 8;
+	buf[4] = n;
+
+	zpu_fifo_deadline(&deadline, BENCH_TIMEOUT_MS);
+	if (zpu_fifo_put_until(zf, buf, 5, &deadline) != 5) {
+		perror("Unable to send command to ZPU");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Bulk CPU to ZPU. The ZPU replies once it has read every byte. */
+static int bench_sink(struct zpu_fifo *zf, uint32_t bytes)
+{
+	struct timespec deadline;
+	uint8_t buf[4096], reply;
+	uint32_t sent = 0, n;
+	long long t0, t1;
+	ssize_t r;
+
+	memset(buf, 0xa5, sizeof(buf));
+
+	t0 = now_ns();
+	if (send_cmd(zf, 'S', bytes)) return 1;
+	while (sent < bytes) {
+		n = bytes - sent;
+		if (n > sizeof(buf)) n = sizeof(buf);
+		zpu_fifo_deadline(&deadline, BENCH_TIMEOUT_MS);
+		r = zpu_fifo_put_until(zf, buf, n, &deadline);
+		if (r <= 0) {
+			perror("Unable to write to ZPU");
+			return 1;
+		}
+		sent += r;
+	}
+	zpu_fifo_deadline(&deadline, BENCH_TIMEOUT_MS);
+	r = zpu_fifo_get_until(zf, &reply, 1, &deadline);
+	if (r != 1 || reply != 'S') {
+		fprintf(stderr, "No sink reply from ZPU\n");
+		return 1;
+	}
+	t1 = now_ns();
+
+	printf("sink_bytes=%u\n", bytes);
+	printf("sink_bytes_per_s=%.0f\n", bytes * 1e9 / (t1 - t0));
+
+	return 0;
+}
+
+/* Bulk ZPU to CPU, checking the byte pattern. The check picks the pattern
+ * back up after a bad byte, so a gap left by an overrun is one error rather
+ * than every byte after it. */
+static int bench_source(struct zpu_fifo *zf, uint32_t bytes, int flow)
+{
+	struct timespec deadline;
+	uint8_t buf[4096], expect = 0;
+	uint32_t got = 0, errors = 0;
+	long long t0, t1;
+	ssize_t r, i;
+
+	t0 = now_ns();
+	if (send_cmd(zf, 'O', bytes)) return 1;
+	t1 = t0;
+	while (got < bytes) {
+		zpu_fifo_deadline(&deadline,
+		  flow ? BENCH_TIMEOUT_MS : BENCH_IDLE_MS);
+		r = zpu_fifo_get_until(zf, buf, sizeof(buf), &deadline);
+		if (r < 0) {
+			if (!flow && errno == ETIMEDOUT) break;
+			perror("Unable to read from ZPU");
+			return 1;
+		}
+		for (i = 0; i < r; i++) {
+			if (buf[i] != expect) errors++;
+			expect = buf[i] + 1;
+		}
+		got += r;
+		t1 = now_ns();
+	}
+
+	printf("source_bytes=%u\n", got);
+	/* Nothing at all may arrive with flow control off */
+	printf("source_bytes_per_s=%.0f\n",
+	  (t1 > t0) ? got * 1e9 / (t1 - t0) : 0.0);
+	/* Without flow control, gaps are overruns and are counted as lost */
+	if (flow) printf("source_errors=%u\n", errors);
+	else printf("source_lost=%u\n", bytes - got);
+
+	return 0;
+}
+
+/* Time count echoes of size bytes. Writes and reads are interleaved, as an
+ * echo may be larger than the ZPU RX FIFO. */
+static int bench_echo(struct zpu_fifo *zf, int size, int count)
+{
+	struct timespec deadline;
+	uint8_t out[BENCH_ECHO_MAX + 2], in[BENCH_ECHO_MAX];
+	long long *rtt, t0;
+	int i, j, wr, rd, errors = 0;
+	ssize_t r;
+
+	rtt = calloc(count, sizeof(long long));
+	if (rtt == NULL) {
+		perror("Unable to allocate samples");
+		return 1;
+	}
+
+	out[0] = 'E';
+	out[1] = size & 0xff;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < size; j++) out[j + 2] = i + j;
+
+		zpu_fifo_deadline(&deadline, BENCH_TIMEOUT_MS);
+		t0 = now_ns();
+		wr = rd = 0;
+		while (rd < size) {
+			if (wr < size + 2) {
+				r = zpu_fifo_put_nb(zf, out + wr, size + 2 - wr);
+				if (r > 0) wr += r;
+				else if (errno != EAGAIN) break;
+			}
+			if (wr < size + 2) {
+				r = zpu_fifo_get_nb(zf, in + rd, size - rd);
+				if (r < 0 && errno == EAGAIN) r = 0;
+			} else {
+				r = zpu_fifo_get_until(zf, in + rd, size - rd,
+				  &deadline);
+			}
+			if (r < 0) break;
+			rd += r;
+		}
+		if (rd < size) {
+			perror("Echo from ZPU failed");
+			free(rtt);
+			return 1;
+		}
+		rtt[i] = now_ns() - t0;
+		if (memcmp(in, out + 2, size)) errors++;
+	}
+
+	qsort(rtt, count, sizeof(long long), cmp_ll);
+	printf("echo_%d_p50_us=%.1f\n", size, rtt[count / 2] / 1000.0);
+	printf("echo_%d_p99_us=%.1f\n", size, rtt[(count * 99) / 100] / 1000.0);
+	printf("echo_%d_max_us=%.1f\n", size, rtt[count - 1] / 1000.0);
+	printf("echo_%d_errors=%d\n", size, errors);
+
+	free(rtt);
+
+	return 0;
+}
+
+/* Run every test with flow control on or off */
+static int bench_run(struct fpga_ctx *fpga, int flow, uint32_t bytes,
+  int count)
+{
+	struct zpu_fifo *zf;
+	int size, ret = 0;
+
+	zf = zpu_fifo_init(fpga, flow ? FLOW_CTRL : NO_FLOW_CTRL);
+	if (zf == NULL) {
+		fprintf(stderr, "Unable to communicate with ZPU!\n");
+		return 1;
+	}
+
+	printf("flow_control=%d\n", flow);
+	for (size = 1; size <= BENCH_ECHO_MAX && !ret; size *= 2)
+		ret = bench_echo(zf, size, count);
+	if (!ret) ret = bench_sink(zf, bytes);
+	/* Last, so a ZPU overrunning the TX FIFO can't upset the others */
+	if (!ret) ret = bench_source(zf, bytes, flow);
+
+	zpu_fifo_deinit(zf);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fpga_ctx *fpga;
+	uint32_t bytes = BENCH_BYTES;
+	int count = 200;
+	int flow_on = 1, flow_off = 1;
+	int c, model, ret = 0;
+
+	static struct option long_options[] = {
+		{ "bytes", 1, 0, 'b' },
+		{ "count", 1, 0, 'n' },
+		{ "flow", 1, 0, 'f' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "b:n:f:h",
+	  long_options, NULL)) != -1) {
+		switch(c) {
+		case 'b':
+			bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'f':
+			flow_on = !strcmp(optarg, "on") || !strcmp(optarg, "both");
+			flow_off = !strcmp(optarg, "off") ||
+			  !strcmp(optarg, "both");
+			break;
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (count < 1 || bytes < 1 || (!flow_on && !flow_off)) {
+		usage(argv);
+		return 1;
+	}
+
+	model = get_model();
+	if(model != 0x4100) {
+		fprintf(stderr, "Unsupported model 0x%X\n", model);
+		return 1;
+	}
+
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
+		/* fpga_init() calls open() which fails with errno set */
+		perror("Can't open FPGA I2C bus");
+		return 1;
+	}
+
+	if (flow_on) ret = bench_run(fpga, 1, bytes, count);
+	if (flow_off && !ret) ret = bench_run(fpga, 0, bytes, count);
+
+	fpga_deinit(fpga);
+
+	return ret;
+}
@@ -0,0 +1,311 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* ZPU MUXBUS broker
+ *
+ * Owns the ZPU FIFO and its IRQ while the zpu_muxbus application runs in the
+ * ZPU, so that any number of processes can use the MUXBUS at once. Clients
+ * connect with zpu_broker_connect(), which ts8820ctl and tsmuxbusctl try
+ * before opening the FIFO themselves, and use the usual zpu_muxbus_* calls.
+ *
+ * Every request waiting when the broker wakes is run as one batch, so
+ * accesses from several clients share FIFO transfers. Each client's accesses
+ * are done in order and are not interleaved with another client's.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fpga.h"
+#include "tszpufifo.h"
+#include "tszpubroker.h"
+
+const char copyright[] = "Copyright (c) embeddedTS - " __DATE__ " - "
+  GITCOMMIT;
+
+#define BROKER_MAX_CLIENTS	32
+
+struct broker_client {
+	int fd;
+	int pending;
+	struct zpu_broker_req req;
+	struct zpu_broker_rep rep;
+};
+
+static struct broker_client clients[BROKER_MAX_CLIENTS];
+static struct zpu_muxbus_op ops[BROKER_MAX_CLIENTS * ZPU_BROKER_MAX_OPS];
+static int nclients;
+
+volatile uint32_t term;
+void termsig(int x) {
+	term = 1;
+}
+
+int get_model()
+{
+	FILE *proc;
+	char mdl[256];
+	char *ptr;
+
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
+	proc = fopen("/proc/device-tree/model", "r");
+	if (!proc) {
+		perror("model");
+		return 0;
+	}
+	fread(mdl, 256, 1, proc);
+	ptr = strstr(mdl, "TS-");
+	return strtoull(ptr+3, NULL, 16);
+}
+
+static void usage(char **argv) {
+	fprintf(stderr,
+	  "%s\n\n"
+	  "Usage: %s [OPTIONS] ...\n"
+	  "embeddedTS ZPU MUXBUS broker\n"
+	  "\n"
+	  "  -s, --socket <path>  Listen on path rather than the ZPU_BROKER\n"
+	  "                         environment variable, or\n"
+	  "                         " ZPU_BROKER_PATH "\n"
+	  "  -h, --help           This message\n"
+	  "\n"
+	  "Runs in the foreground until signalled, sharing the ZPU MUXBUS\n"
+	  "application between processes. The zpu_muxbus application must\n"
+	  "already be running in the ZPU.\n"
+	  "\n",
+	  copyright, argv[0]
+	);
+}
+
+static void client_close(int i)
+{
+	close(clients[i].fd);
+	clients[i] = clients[--nclients];
+}
+
+/* Take a request from client i. Returns 0 if it is queued for the next batch,
+ * or -1 if the client has gone. A request that is not valid is answered
+ * straight away with EINVAL.
+ */
+static int client_recv(int i)
+{
+	struct broker_client *c = &clients[i];
+	ssize_t ret;
+	int j;
+
+	ret = recv(c->fd, &c->req, sizeof(c->req), 0);
+	if (ret <= 0) return -1;
+	if (ret < (ssize_t)offsetof(struct zpu_broker_req, ops)) return -1;
+
+	c->rep.seq = c->req.seq;
+	c->rep.err = 0;
+	if (c->req.nops > ZPU_BROKER_MAX_OPS ||
+	  ret != (ssize_t)offsetof(struct zpu_broker_req, ops[c->req.nops]))
+		c->rep.err = EINVAL;
+	for (j = 0; j < c->req.nops && !c->rep.err; j++) {
+		if (c->req.ops[j].count > 64) c->rep.err = EINVAL;
+	}
+	if (c->rep.err) {
+		send(c->fd, &c->rep, offsetof(struct zpu_broker_rep, dat),
+		  MSG_NOSIGNAL);
+		return 0;
+	}
+
+	c->pending = 1;
+	return 0;
+}
+
+/* Run every pending request as one batch and answer each. The batch has the
+ * shortest deadline of the requests in it, and if it fails, every request in
+ * it is answered with the error.
+ *
+ * Returns 0, or the errno the batch failed with.
+ */
+static int broker_batch(struct zpu_fifo *zf)
+{
+	struct timespec deadline, *dl = NULL;
+	struct broker_client *c;
+	size_t len;
+	int i, j, n = 0, ms = -1, err = 0, pending = 0;
+
+	for (i = 0; i < nclients; i++) {
+		c = &clients[i];
+		if (!c->pending) continue;
+		pending++;
+		len = 0;
+		for (j = 0; j < c->req.nops; j++) {
+			ops[n].adr = c->req.ops[j].adr;
+			ops[n].dat = c->req.ops[j].dat;
+			ops[n].count = c->req.ops[j].count;
+			ops[n].buf = c->rep.dat + len;
+			len += ops[n].count * 2;
+			n++;
+		}
+		if (c->req.timeout_ms >= 0 &&
+		  (ms < 0 || c->req.timeout_ms < ms))
+			ms = c->req.timeout_ms;
+	}
+	if (!pending) return 0;
+
+	if (ms >= 0) {
+		zpu_fifo_deadline(&deadline, ms);
+		dl = &deadline;
+	}
+	if (zpu_muxbus_batch_until(zf, ops, n, dl)) err = errno;
+
+	for (i = 0; i < nclients; i++) {
+		c = &clients[i];
+		if (!c->pending) continue;
+		c->pending = 0;
+		len = offsetof(struct zpu_broker_rep, dat);
+		c->rep.err = err;
+		for (j = 0; j < c->req.nops && !err; j++)
+			len += c->req.ops[j].count * 2;
+		send(c->fd, &c->rep, len, MSG_NOSIGNAL);
+	}
+
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd[BROKER_MAX_CLIENTS + 1];
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct fpga_ctx *fpga;
+	struct zpu_fifo *zf;
+	const char *path = NULL;
+	int c, i, fd, lfd, model, ret = 1;
+
+	static struct option long_options[] = {
+		{ "socket", 1, 0, 's' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while((c = getopt_long(argc, argv, "s:h",
+	  long_options, NULL)) != -1) {
+		switch(c) {
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (path == NULL) path = getenv("ZPU_BROKER");
+	if (path == NULL) path = ZPU_BROKER_PATH;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Socket path is too long\n");
+		return 1;
+	}
+
+	model = get_model();
+	if(model != 0x4100) {
+		fprintf(stderr, "Unsupported model 0x%X\n", model);
+		return 1;
+	}
+
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
+		/* fpga_init() calls open() which fails with errno set */
+		perror("Can't open FPGA I2C bus");
+		return 1;
+	}
+
+	zf = zpu_fifo_init(fpga, FLOW_CTRL);
+	if (zf == NULL) {
+		fprintf(stderr, "Unable to communicate with ZPU!\n");
+		goto out_fpga;
+	}
+
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		perror("Unable to create socket");
+		goto out_fifo;
+	}
+
+	/* A socket left behind by a broker that did not exit cleanly */
+	unlink(path);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	  listen(lfd, BROKER_MAX_CLIENTS)) {
+		perror(path);
+		goto out_sock;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = termsig;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	ret = 0;
+	while (!term) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfd[i + 1].fd = clients[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+
+		if (poll(pfd, nclients + 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+
+		/* Walk backwards, as a closed client is replaced by the last */
+		for (i = nclients - 1; i >= 0; i--) {
+			if (!pfd[i + 1].revents) continue;
+			if (client_recv(i)) client_close(i);
+		}
+
+		/* The ZPU is left part way through a command, only a reset of
+		 * the ZPU application gets it back */
+		if (broker_batch(zf) == EIO) {
+			fprintf(stderr, "ZPU MUXBUS out of sync\n");
+			ret = 1;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(lfd, NULL, NULL);
+			if (fd >= 0 && nclients == BROKER_MAX_CLIENTS) {
+				fprintf(stderr, "Too many clients\n");
+				close(fd);
+			} else if (fd >= 0) {
+				clients[nclients].fd = fd;
+				clients[nclients].pending = 0;
+				nclients++;
+			}
+		}
+	}
+
+	while (nclients) client_close(nclients - 1);
+	unlink(path);
+out_sock:
+	close(lfd);
+out_fifo:
+	zpu_fifo_deinit(zf);
+out_fpga:
+	fpga_deinit(fpga);
+
+	return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef __TSZPUBROKER_H__
+#define __TSZPUBROKER_H__
+
+#include <stdint.h>
+
+/* Messages between tszpubroker and the clients of zpu_broker_connect()
+ *
+ * Each request and reply is one packet on a SOCK_SEQPACKET Unix socket. Both
+ * ends are on the same CPU, so fields are in host byte order.
+ */
+
+/* Socket used when no path is given, overridden by ZPU_BROKER in the
+ * environment */
+#define ZPU_BROKER_PATH		"/run/tszpubroker.sock"
+/* Most MUXBUS accesses in one request, and so the largest reply */
+#define ZPU_BROKER_MAX_OPS	64
+#define ZPU_BROKER_MAX_READ	(ZPU_BROKER_MAX_OPS * 64 * 2)
+
+/* One MUXBUS access, as struct zpu_muxbus_op less the buffer */
+struct zpu_broker_op {
+	uint16_t adr;
+	uint16_t dat;
+	uint8_t count;
+	uint8_t pad[3];
+};
+
+/* timeout_ms of -1 waits as long as it takes */
+struct zpu_broker_req {
+	uint32_t seq;
+	int32_t timeout_ms;
+	uint16_t nops;
+	uint16_t pad;
+	struct zpu_broker_op ops[ZPU_BROKER_MAX_OPS];
+};
+
+/* err is 0 or an errno value. On success, dat holds the words read by each
+ * read in the request, in order. */
+struct zpu_broker_rep {
+	uint32_t seq;
+	int32_t err;
+	uint8_t dat[ZPU_BROKER_MAX_READ];
+};
+
+#endif // __TSZPUBROKER_H__
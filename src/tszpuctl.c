@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <errno.h>
 #include <stdint.h>
 #include <linux/types.h>
@@ -23,8 +24,15 @@
 
 #include "fpga.h"
 #include "tszpufifo.h"
+#include "tszputrace.h"
 
-static int twifd;
+static struct fpga_ctx *fpga;
+
+/* With --stats, FPGA bus statistics are printed to stderr on exit */
+static void print_stats(void)
+{
+	if (fpga != NULL) fpga_stats_print(fpga, stderr);
+}
 
 const char copyright[] = "Copyright (c) embeddedTS - " __DATE__ " - "
   GITCOMMIT;
@@ -47,6 +55,9 @@ int get_model()
 	char mdl[256];
 	char *ptr;
 
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
 	proc = fopen("/proc/device-tree/model", "r");
 	if (!proc) {
 		perror("model");
@@ -67,15 +78,36 @@ void usage(char **argv) {
 	  "                       or binary file in the ZPU\n"
 	  "  -s, --save         Reset ZPU and output entire ZPU RAM to stdout\n"
 	  "  -x, --connect      Connect stdin/stdout to ZPU\n"
+	  "      --coalesce <bytes>[,<us>]\n"
+	  "                     With --connect, have the ZPU hold back its IRQ\n"
+	  "                       until <bytes> are waiting or the oldest has\n"
+	  "                       waited <us>, either may be 0 to leave it out\n"
+	  "      --trace <elf>  With --connect, render TRACE() records using\n"
+	  "                       the format strings in the firmware ELF\n"
 	  "  -c, --compile      Output a <filename>.bin in the same path\n"
 	  "  -i, --info         Print execution status of the ZPU\n"
 	  "  -r, --reset <1|0>  Reset ZPU (1 off, 0 on)\n"
+	  "      --stats        Print FPGA bus statistics on exit\n"
 	  "  -h, --help         This message\n"
 	  "\n",
 	  copyright, argv[0]
 	);
 }
 
+/* Write data read from the ZPU to stdout as it arrives, until a signal */
+static int connect_out(void *arg, const uint8_t *data, size_t len)
+{
+	fwrite(data, 1, len, (FILE *)arg);
+	return term;
+}
+
+/* As connect_out(), decoding trace records with --trace */
+static int connect_trace(void *arg, const uint8_t *data, size_t len)
+{
+	zpu_trace_write((struct zpu_trace *)arg, data, len, stdout);
+	return term;
+}
+
 int zpucompile(char *infile, char *outfile) 
 {
 	char cmd[8192];
@@ -105,11 +137,15 @@ int main(int argc, char **argv)
 	int opt_reset = 0;
 	int opt_connect = 0;
 	int opt_save = 0;
+	int opt_stats = 0;
+	char *opt_coalesce = 0;
+	char *opt_trace = 0;
 	char *compile_path = 0;
 	char *opt_load = 0;
 	int model;
 	uint8_t rev, sub;
 	uint8_t buf[8192];
+	struct fpga_xfer xfer;
 
 	static struct option long_options[] = {
 		{ "save", 0, 0, 's' },
@@ -118,6 +154,9 @@ int main(int argc, char **argv)
 		{ "info", 0, 0, 'i' },
 		{ "reset", 1, 0, 'r' },
 		{ "load", 1, 0, 'l' },
+		{ "stats", 0, 0, 'S' },
+		{ "coalesce", 1, 0, 'C' },
+		{ "trace", 1, 0, 'T' },
 		{ "help", 0, 0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
@@ -127,12 +166,12 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if(twifd == -1) {
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
 		perror("Can't open FPGA I2C bus");
 		return 1;
 	}
 
-	twifd = fpga_init("/dev/i2c-2", 0x28);
 	model = get_model();
 	if(model != 0x4100) {
 		fprintf(stderr, "Unsupported model 0x%X\n", model);
@@ -142,8 +181,10 @@ int main(int argc, char **argv)
 	/* Ensure that the FPGA revision is 0xA or higher but only on stock
 	 * FPGA builds. Custom builds are exempt from this restruction.
 	 */
-	rev = fpeek8(twifd, 306);
-	sub = fpeek8(twifd, 307);
+	fpga_xfer_begin(&xfer, fpga);
+	fpga_xfer_peek8(&xfer, 306, &rev);
+	fpga_xfer_peek8(&xfer, 307, &sub);
+	fpga_xfer_commit(&xfer);
 	if (rev < 0xA && sub == 0) {
 		fprintf(stderr, "TS-4100 FPGA must be rev 0xA or higher!\n");
 		fprintf(stderr, "Current rev is 0x%X\n", rev);
@@ -173,11 +214,25 @@ int main(int argc, char **argv)
 		case 'l':
 			opt_load = strdup(optarg);
 			break;
+		case 'C':
+			opt_coalesce = optarg;
+			break;
+		case 'T':
+			opt_trace = optarg;
+			break;
+		case 'S':
+			opt_stats = 1;
+			break;
 		default:
 			usage(argv);
 		}
 	}
 
+	if (opt_stats) {
+		fpga_stats_enable(fpga);
+		atexit(print_stats);
+	}
+
 	if(compile_path)
 	{
 		char outfile[PATH_MAX];
@@ -240,13 +295,12 @@ int main(int argc, char **argv)
 		fclose(f);
 
 		/* Put ZPU in reset, program, take it out of reset */
-		fpoke8(twifd, 19, 0x3);
+		fpoke8(fpga, 19, 0x3);
 
-		/* 4094 is the max size so pokes must be broken up */
-		fpokestream8(twifd, buf,	8192,		4094);
-		fpokestream8(twifd, &buf[4094],	8192+4094,	4094);
-		fpokestream8(twifd, &buf[8188],	8192+4094+4094,	4);
-		fpoke8(twifd, 19, 0x0);
+		fpga_write_range(fpga, 8192, buf, 8192);
+		fpoke8(fpga, 19, 0x0);
+		/* Nothing known of the FPGA before the new ZPU code ran holds */
+		fpga_cache_invalidate(fpga);
 		unlink(tempfile);
 	}
 
@@ -259,55 +313,81 @@ int main(int argc, char **argv)
 			  "Refusing to write binary to the terminal.\n");
 			fprintf(stderr,
 			  "Did you mean \"%s --save | hexdump -C\"?\n",argv[0]);
-			close(twifd);
+			fpga_deinit(fpga);
+			fpga = NULL;
 			return 1;
 		}
 		/* Need to save the ZPU state, and put it in reset while we read
 		 * memory. Make sure to restore state after rather than just
 		 * un-resetting blindly.
 		 */
-		reset_state = fpeek8(twifd, 19);
-		fpoke8(twifd, 19, 0x3);
+		reset_state = fpeek8(fpga, 19);
+		fpoke8(fpga, 19, 0x3);
 
-		/* 4094 is the max size so pokes must be broken up */
-		ret |= fpeekstream8(twifd, buf,		8192,		4094);
-		ret |= fpeekstream8(twifd, &buf[4094],	8192+4094,	4094);
-		ret |= fpeekstream8(twifd, &buf[8188],	8192+4094+4094,	4);
+		ret = fpga_read_range(fpga, 8192, buf, 8192);
 
-		fpoke8(twifd, 19, reset_state);
+		fpoke8(fpga, 19, reset_state);
 		fwrite(buf, 1, 8192, stdout);
 		if (ret) return 1;
 	}
 
 	if(opt_reset) {
 		if(opt_reset == 1) {
-			fpoke8(twifd, 19, 0x0);
+			fpoke8(fpga, 19, 0x0);
 		} else {
-			fpoke8(twifd, 19, 0x3);
+			fpoke8(fpga, 19, 0x3);
 		}
+		fpga_cache_invalidate(fpga);
 	}
 
 	if(opt_info) {
-		uint8_t rst = fpeek8(twifd, 19);
-		uint8_t brk = fpeek8(twifd, 18);
+		uint8_t rst, brk;
+
+		fpga_xfer_begin(&xfer, fpga);
+		fpga_xfer_peek8(&xfer, 19, &rst);
+		fpga_xfer_peek8(&xfer, 18, &brk);
+		/* fpga_xfer_commit() reports the error */
+		if (fpga_xfer_commit(&xfer)) return 1;
 
 		printf("zpu_in_reset=%d\n", (rst & 0x3) == 0x3 ? 1 : 0);
 		printf("zpu_in_break=%d\n", (brk & 0x4) ? 1 : 0);
 	}
 
 	if(opt_connect) {
-		int irqfd;
+		struct zpu_fifo *zf;
+		struct zpu_trace *trace = NULL;
 		ssize_t r;
 		size_t wrsz;
-		int rdsz;
-		fd_set rfds, efds;
+		struct pollfd pfd[2];
+		int irq_more = 0;
 
-		irqfd = zpu_fifo_init(twifd, 1);
-		if (irqfd == -1) {
+		if (opt_trace) {
+			trace = zpu_trace_open(opt_trace);
+			if (trace == NULL) {
+				perror(opt_trace);
+				return 1;
+			}
+		}
+
+		zf = zpu_fifo_init(fpga, 1);
+		if (zf == NULL) {
 			fprintf(stderr, "Unable to communicate with ZPU!\n");
 			return 1;
 		}
 
+		if (opt_coalesce) {
+			char *end;
+			unsigned int bytes, us = 0;
+
+			bytes = strtoul(opt_coalesce, &end, 0);
+			if (*end == ',') us = strtoul(end + 1, NULL, 0);
+			if (zpu_fifo_set_coalesce(zf, bytes, us)) {
+				perror("Unable to set ZPU IRQ coalescing");
+				zpu_fifo_deinit(zf);
+				return 1;
+			}
+		}
+
 		/* Catch any signals that might be received.
 		 * Later used to gracefully shutdown the FIFO pipe
 		 */
@@ -338,77 +418,75 @@ int main(int argc, char **argv)
 		/* Set stdout to be unbuffered */
 		setvbuf(stdout, NULL, _IONBF, 0);
 
-		FD_ZERO(&rfds);
-		FD_ZERO(&efds);
+		pfd[0].fd = zpu_fifo_fd(zf);
+		pfd[0].events = zpu_fifo_irq_events(zf);
+		pfd[0].revents = 0;
+		pfd[1].fd = 0;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
 
 		while(1) {
 			/* When there is an interrupt from the ZPU, read the
 			 * current FIFO tail; this clears the IRQ from FPGA. */
-			if (FD_ISSET(irqfd, &efds)) {
-				do {
-					rdsz = zpu_fifo_get(twifd, buf, 256);
-					fwrite(buf, 1, rdsz, stdout);
-				} while (rdsz && !term);
+			if (irq_more || (pfd[0].revents & pfd[0].events)) {
+				if (trace) {
+					zpu_fifo_get_cb(zf, SIZE_MAX,
+					  connect_trace, trace);
+				} else {
+					zpu_fifo_get_cb(zf, SIZE_MAX,
+					  connect_out, stdout);
+				}
 			}
 
 			/* Read data from stdin and write it out to the FIFO.
 			 * Since it is possible to not do a full write, need to
 			 * loop until all data is written out.
 			 */
-			if (FD_ISSET(0, &rfds)) {
+			if (pfd[1].revents & (POLLIN | POLLHUP)) {
 				wrsz = 0;
 				r = read(0, buf, 16);
 				if (r > 0) {
 					do {
-						wrsz = wrsz + zpu_fifo_put(twifd,
+						wrsz = wrsz + zpu_fifo_put(zf,
 						  buf + wrsz, r - wrsz);
 					} while (r != wrsz);
 				} else if (r == 0) { /* EOF */
-					zpu_fifo_deinit(twifd);
+					zpu_fifo_deinit(zf);
 					break;
 				}
 			}
 
 			/* This process recevied a signal of some kind */
 			if (term) {
-				zpu_fifo_deinit(twifd);
+				zpu_fifo_deinit(zf);
 				break;
 			}
 
 			/* Prioritize IRQs from ZPU.
 			 *
-			 * Above, the GPIO is set up with rising edge polarity.
-			 * When this is set, select() is used on the GPIO value
-			 * file to indicate when a change has happened.
-			 *
+			 * The IRQ is consumed once the FIFO has been drained.
 			 * At this point, the interrupt should have been cleared
 			 * and if it is not, that means there is another IRQ
-			 * pending. The value file is read, if it is a 1, then
-			 * it means another interrupt is already ready. In order
-			 * to ensure data gets in and out quickly, continue the
-			 * while loop to get that data read out.
+			 * pending. In order to ensure data gets in and out
+			 * quickly, that data is read out on the next pass
+			 * without waiting, with poll() only checking stdin so
+			 * that input and signals are not held up behind it.
 			 *
-			 * If the value read is a 0, then there is no other IRQ
-			 * pending, the FDs are reset, and select() is eval'ed
-			 * again.
+			 * Otherwise, poll() is called again to wait for either
+			 * an IRQ or input. The IRQ revents are cleared either
+			 * way, so only a new IRQ is acked next time.
 			 */
-			if (FD_ISSET(irqfd, &efds)) {
-				char x = '?';
-				lseek(irqfd, 0, 0);
-				read(irqfd, &x, 1);
-				assert (x == '0' || x == '1');
-				if (x == '1') continue;	
-			} else {
-				FD_SET(irqfd, &efds);
+			pfd[1].revents = 0;
+			if (irq_more || (pfd[0].revents & pfd[0].events)) {
+				pfd[0].revents = 0;
+				irq_more = (zpu_fifo_irq_ack(zf, NULL) == 1);
 			}
 
-			FD_SET(0, &rfds);
-
-			i = select(irqfd + 1, &rfds, NULL, &efds, NULL);
+			i = poll(pfd, 2, irq_more ? 0 : -1);
 			if (i == -1) {
-				FD_CLR(0, &rfds);
-				FD_CLR(irqfd, &efds);
-			} 
+				pfd[0].revents = 0;
+				pfd[1].revents = 0;
+			}
 		}
 
 		/* Upon exit of this main loop, restore term settings if we were
@@ -417,9 +495,12 @@ int main(int argc, char **argv)
 		if (isatty(0)) {
 			tcsetattr(0, TCSANOW, &tios_orig);
 		}
+		zpu_trace_close(trace);
 	}
 
-	close(twifd);
+	if (opt_stats) print_stats();
+	fpga_deinit(fpga);
+	fpga = NULL;
 
 	return 0;
 }
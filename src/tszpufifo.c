@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <getopt.h>
 #include <asm-generic/ioctls.h>
@@ -12,6 +13,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <stdint.h>
 #include <linux/types.h>
@@ -20,42 +24,493 @@
 #include <sys/time.h>
 #include <termios.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <gpiod.h>
+#include <pthread.h>
 
 #include "fpga.h"
 #include "gpiolib.h"
+#include "tszpufifo.h"
+#include "tszpubroker.h"
 
-/* CPU GPIO number for the IRQ that the ZPU can control */
+/* CPU GPIO number for the IRQ that the ZPU can control, and the same GPIO as
+ * a gpiochip and line offset for libgpiod */
 #define FPGA_IRQ	129
+#define FPGA_IRQ_CHIP	4
+#define FPGA_IRQ_LINE	1
 /* These numbers are from the perspective of the FPGA top level decode */
 #define ZPU_RAM_START	0x2000
 #define ZPU_RAM_SZ	0x2000
+/* Largest FIFO the 12 bit size fields of the flags word can describe */
+#define ZPU_FIFO_MAX	0xfff
+/* FPGA main clock, which the ZPU TIMER_REG counts */
+#define ZPU_CLK_MHZ	63
+/* Flags word options, the CPU only writes the top byte */
+#define ZPU_COALESCE_OPT	(1 << 24)
+#define ZPU_NOFLOW_OPT		(1 << 25)
 
-static int irqfd;
-static uint32_t fifo_adr;
-static uint32_t fifo_flags;
-/* RX and TX naming is from the ZPU's point of view */
-static uint16_t txfifo_sz, txfifo_put_adr, txfifo_dat_adr, txfifo_get_adr;
-static uint16_t rxfifo_sz, rxfifo_put_adr, rxfifo_dat_adr, rxfifo_get_adr;
-static uint8_t txget, rxget, rxfifo_spc;
-static uint8_t txput = 0, rxput = 0;
+/* One connection to the FIFO of a running ZPU application, returned by
+ * zpu_fifo_init() and passed to every other call.
+ */
+struct zpu_fifo {
+	struct fpga_ctx *fpga;
+	int irqfd;
+	/* Set when the IRQ is a libgpiod line event rather than the sysfs value file */
+	struct gpiod_chip *irqchip;
+	struct gpiod_line *irqline;
+	/* Set when the IRQ is provided by the FPGA transport, see fpga_irq_fd() */
+	int irq_transport;
+	uint32_t fifo_adr;
+	uint32_t fifo_flags;
+	/* RX and TX naming is from the ZPU's point of view */
+	uint16_t txfifo_sz, txfifo_put_adr, txfifo_dat_adr, txfifo_get_adr;
+	uint16_t rxfifo_sz, rxfifo_put_adr, rxfifo_dat_adr, rxfifo_get_adr;
+	/* IRQ coalescing word, 0 if the ZPU application does not support it */
+	uint16_t coalesce_adr;
+	uint16_t txget, rxget, rxfifo_spc;
+	uint16_t txput, rxput;
+	/* Cursors as read from the ZPU, see zpu_cursor_peek() */
+	uint8_t txput_raw[3], rxget_raw[3];
+	/* TX FIFO tail not yet written back to the ZPU, and the number of bytes to
+	 * speculatively read from the TX FIFO on the next drain */
+	int txget_pending;
+	uint16_t txfifo_spec;
+	/* Laid out like the ZPU TX ring, so zpu_fifo_get_cb() can hand out each
+	 * drain as the ring's own one or two segments */
+	uint8_t txmirror[ZPU_FIFO_MAX];
+	/* Hybrid completion wait, see zpu_done_wait() */
+	long long spin_avg_ns;
+	int spin_skip;
+	unsigned long spin_done, irq_done;
+	/* Socket to tszpubroker when the handle is from zpu_broker_connect(),
+	 * otherwise -1, and the sequence number of the last request on it */
+	int broker_fd;
+	uint32_t broker_seq;
+	/* Set when a MUXBUS command could only be partly sent, the ZPU is then
+	 * waiting on the rest of it and every MUXBUS call fails with EIO */
+	int muxbus_desync;
+	/* lock guards the FIFO state above, cmd_lock keeps a MUXBUS command and
+	 * its reply together when the handle is shared between threads */
+	pthread_mutex_t lock;
+	pthread_mutex_t cmd_lock;
+};
+
+/* Longest average completion time that is polled for, and how often
+ * completions are polled for anyway when they take longer */
+#define ZPU_SPIN_MAX_NS	500000
+#define ZPU_SPIN_PROBE	64
+/* Smallest speculative drain, large enough for any MUXBUS reply */
+#define ZPU_TX_SPEC_MIN	16
+/* Largest put in one transaction, leaving room in the transaction buffer for
+ * the cursor updates that go with it */
+#define ZPU_RX_FILL_MAX	(FPGA_XFER_BUF_SZ - 64)
+/* Attempts at reading a cursor the ZPU is moving before giving up */
+#define ZPU_CURSOR_TRIES	8
+/* Most reads one drain is split in to, by the ring wrapping and by iovec
+ * entries. Each read is two I2C messages, which leaves room for the cursors
+ * in the same transaction. */
+#define ZPU_DRAIN_SEGS	16
+
+/* One read of a drain, len bytes at pos in the TX ring in to buf */
+struct zpu_drain_seg {
+	uint8_t *buf;
+	uint16_t pos;
+	uint16_t len;
+};
+
+/* FIFO cursors
+ *
+ * Each FIFO head and tail is a 32-bit word in ZPU RAM, written by one side and
+ * read by the other. A FIFO of up to 256 bytes only uses the low byte, which is
+ * read and written on its own. Larger FIFOs use the low 16 bits. The FPGA
+ * moves ZPU RAM over I2C a byte at a time, so either side could see a 16 bit
+ * cursor half way through an update. To catch this, the high byte is repeated
+ * in bits 23:16, which the CPU writes after, and reads after, the low 16 bits.
+ * A cursor whose two copies of the high byte differ is mid update and is
+ * ignored until it is read again.
+ */
+
+/* Queue a read of the cursor with its low byte at adr, for a FIFO of sz bytes,
+ * in to raw. Decode it with zpu_cursor_val() once the transaction is done.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_cursor_peek(struct fpga_xfer *xfer, uint16_t adr, uint16_t sz,
+  uint8_t *raw)
+{
+	raw[0] = raw[1] = 0;
+	if (sz <= 256) {
+		fpga_xfer_peek8(xfer, adr, &raw[2]);
+	} else {
+		fpga_xfer_peekstream8(xfer, &raw[1], adr - 1, 2);
+		fpga_xfer_peek8(xfer, adr - 2, &raw[0]);
+	}
+}
+
+/* Decode a cursor read with zpu_cursor_peek() in to val.
+ * Returns 0, or -1 if it was read mid update and val is left alone.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_cursor_val(uint8_t *raw, uint16_t sz, uint16_t *val)
+{
+	uint16_t v = (raw[1] << 8) | raw[2];
+
+	if (raw[0] != raw[1] || v >= sz) return -1;
+	*val = v;
+
+	return 0;
+}
+
+/* Queue a write of val to the cursor with its low byte at adr, for a FIFO of
+ * sz bytes.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_cursor_poke(struct fpga_xfer *xfer, uint16_t adr, uint16_t sz,
+  uint16_t val)
+{
+	uint8_t raw[2];
+
+	if (sz <= 256) {
+		fpga_xfer_poke8(xfer, adr, val);
+	} else {
+		raw[0] = val >> 8;
+		raw[1] = val & 0xff;
+		fpga_xfer_pokestream8(xfer, raw, adr - 1, 2);
+		fpga_xfer_poke8(xfer, adr - 2, raw[0]);
+	}
+}
+
+/* Queue the TX FIFO tail write back to the ZPU, if one is owed, in xfer.
+ * The write back after a drain is deferred so it rides along with the next
+ * FIFO transaction rather than costing one of its own.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_tx_ack(struct zpu_fifo *f, struct fpga_xfer *xfer)
+{
+	if (f->txget_pending) {
+		zpu_cursor_poke(xfer, f->txfifo_get_adr, f->txfifo_sz,
+		  f->txget);
+		f->txget_pending = 0;
+	}
+}
+
+/* Queue a write of the IRQ coalescing word in xfer. The word is written high
+ * byte first; the ZPU may see a mix of old and new settings while it is
+ * written, which only affects the IRQs of that moment.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_coalesce_poke(struct zpu_fifo *f, struct fpga_xfer *xfer,
+  uint32_t val)
+{
+	uint8_t buf[4];
+
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+	fpga_xfer_pokestream8(xfer, buf, f->coalesce_adr, 4);
+}
 
-/* Recalculate the ZPU RX buffer free space.
+/* Work out the ZPU RX buffer free space from the last known ZPU tail.
  * Used to update the local rxfifo_spc variable.
  *
  * Not intended to be called directly
  */
-static void zpu_rx_recalc(int twifd)
+static void zpu_rx_space(struct zpu_fifo *f)
 {
-	if (rxfifo_spc != (rxfifo_sz - 1)) {
-		rxget = fpeek8(twifd, rxfifo_get_adr);
-		if (rxget <= rxput) {
-			rxfifo_spc =
-			  rxfifo_sz - (rxput - rxget) - 1;
-		} else {
-			rxfifo_spc =
-			  rxfifo_sz -
-			  (rxput + (rxfifo_sz - rxget)) - 1;
+	if (f->rxget <= f->rxput) {
+		f->rxfifo_spc =
+		  f->rxfifo_sz - (f->rxput - f->rxget) - 1;
+	} else {
+		f->rxfifo_spc =
+		  f->rxfifo_sz -
+		  (f->rxput + (f->rxfifo_sz - f->rxget)) - 1;
+	}
+}
+
+/* Recalculate the ZPU RX buffer free space by reading the ZPU tail.
+ * Used to update the local rxfifo_spc variable.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_rx_recalc(struct zpu_fifo *f)
+{
+	struct fpga_xfer xfer;
+
+	if (f->rxfifo_spc != (f->rxfifo_sz - 1)) {
+		fpga_xfer_begin(&xfer, f->fpga);
+		zpu_cursor_peek(&xfer, f->rxfifo_get_adr, f->rxfifo_sz,
+		  f->rxget_raw);
+		if (fpga_xfer_commit(&xfer) == 0)
+			zpu_cursor_val(f->rxget_raw, f->rxfifo_sz, &f->rxget);
+		zpu_rx_space(f);
+	}
+}
+
+/* FIFO IRQ
+ *
+ * The ZPU raises the FPGA IRQ line, GPIO 129, to signal the CPU. It is
+ * requested as a libgpiod rising edge event. Each edge is queued by the
+ * kernel with a timestamp, and the event fd becomes readable (POLLIN) until
+ * the events are read, so waiting costs a single poll() with no lseek()/read()
+ * of a value file. If the line can't be requested from libgpiod, or the
+ * ZPU_IRQ_SYSFS environment variable is set, the sysfs GPIO interface is used
+ * instead, where the value file signals an edge as an exception (POLLPRI).
+ * A transport with an IRQ of its own, such as the simulated FPGA, is used in
+ * place of either, as an eventfd (POLLIN).
+ *
+ * Either way, the fd returned by zpu_fifo_init() is waited on for the events
+ * in zpu_fifo_irq_events(f), and zpu_fifo_irq_ack() is called once it is
+ * ready. zpu_fifo_irq_wait() does both.
+ */
+
+/* Open the IRQ and drain anything already pending. Returns the fd to wait on,
+ * or -1 on failure.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_irq_open(struct zpu_fifo *f)
+{
+	char gpio_buf[64];
+	char x = '?';
+
+	f->irqchip = NULL;
+	f->irqline = NULL;
+	f->irq_transport = 0;
+	f->irqfd = fpga_irq_fd(f->fpga);
+	if (f->irqfd >= 0) {
+		f->irq_transport = 1;
+		return f->irqfd;
+	}
+
+	if (getenv("ZPU_IRQ_SYSFS") == NULL)
+		f->irqchip = gpiod_chip_open_by_number(FPGA_IRQ_CHIP);
+	if (f->irqchip != NULL) {
+		f->irqline = gpiod_chip_get_line(f->irqchip, FPGA_IRQ_LINE);
+		if (f->irqline != NULL &&
+		  gpiod_line_request_rising_edge_events(f->irqline,
+		  "tszpufifo") == 0) {
+			f->irqfd = gpiod_line_event_get_fd(f->irqline);
+			/* So an ack with no edge queued does not block */
+			fcntl(f->irqfd, F_SETFL,
+			  fcntl(f->irqfd, F_GETFL) | O_NONBLOCK);
+			return f->irqfd;
+		}
+		gpiod_chip_close(f->irqchip);
+		f->irqchip = NULL;
+		f->irqline = NULL;
+	}
+
+	/* Use gpiolib functions to open IRQ, set input, and rising edge trig */
+	gpio_export(FPGA_IRQ);
+	gpio_direction(FPGA_IRQ, 0);
+	gpio_setedge(FPGA_IRQ, 1, 0);
+
+	snprintf(gpio_buf, sizeof(gpio_buf), "/sys/class/gpio/gpio%d/value",
+	  FPGA_IRQ);
+	f->irqfd = open(gpio_buf, O_RDONLY);
+
+	/* Drain the IRQ FD in case there is a spurious IRQ waiting */
+	lseek(f->irqfd, 0, 0);
+	read(f->irqfd, &x, 1);
+
+	return f->irqfd;
+}
+
+/* Returns the poll() events that indicate an IRQ on the IRQ fd. For select(),
+ * POLLIN is readfds and POLLPRI is exceptfds.
+ *
+ * Can be called directly.
+ */
+short zpu_fifo_irq_events(struct zpu_fifo *f)
+{
+	return (f->irqline != NULL || f->irq_transport) ? POLLIN : POLLPRI;
+}
+
+/* Returns which IRQ path is in use, "gpiod", "sysfs", or "transport". Only
+ * "gpiod" has kernel timestamps of the edges, see zpu_fifo_irq_ack().
+ *
+ * Can be called directly.
+ */
+const char *zpu_fifo_irq_name(struct zpu_fifo *f)
+{
+	if (f->irq_transport) return "transport";
+	return (f->irqline != NULL) ? "gpiod" : "sysfs";
+}
+
+/* Consume the IRQ after the IRQ fd was ready. If ts is not NULL, it is set to
+ * the CLOCK_MONOTONIC time of the most recent edge as timestamped by the
+ * kernel, or without libgpiod, the time the IRQ was consumed. Never blocks, so may
+ * also be called again while the line stays asserted with no new edge, when
+ * ts is left as it is.
+ *
+ * Returns 1 if the IRQ line is still asserted, meaning there is more to do
+ * before waiting again, 0 if it is not, or -1 on error.
+ *
+ * Can be called directly.
+ */
+int zpu_fifo_irq_ack(struct zpu_fifo *f, struct timespec *ts)
+{
+	struct gpiod_line_event ev[16];
+	struct timespec mono, real;
+	long long ev_ns, mono_ns, real_ns;
+	char x = '?';
+	uint64_t edges;
+	int n;
+
+	if (f->irq_transport) {
+		if (ts) clock_gettime(CLOCK_MONOTONIC, ts);
+		if (read(f->irqfd, &edges, sizeof(edges)) < 0 && errno != EAGAIN)
+			return -1;
+		return fpga_irq_level(f->fpga) == 1;
+	}
+
+	if (f->irqline == NULL) {
+		if (ts) clock_gettime(CLOCK_MONOTONIC, ts);
+		lseek(f->irqfd, 0, 0);
+		if (read(f->irqfd, &x, 1) != 1) return -1;
+		assert (x == '0' || x == '1');
+		return (x == '1');
+	}
+
+	n = gpiod_line_event_read_fd_multiple(f->irqfd, ev, 16);
+	if (n < 0 && errno == EAGAIN) n = 0;
+	if (n < 0) return -1;
+
+	if (ts && n > 0) {
+		/* Older kernels stamp events with CLOCK_REALTIME, newer ones
+		 * with CLOCK_MONOTONIC. Whichever is closer to now is used. */
+		*ts = ev[n - 1].ts;
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		clock_gettime(CLOCK_REALTIME, &real);
+		ev_ns = ts->tv_sec * 1000000000LL + ts->tv_nsec;
+		mono_ns = mono.tv_sec * 1000000000LL + mono.tv_nsec;
+		real_ns = real.tv_sec * 1000000000LL + real.tv_nsec;
+		if (llabs(real_ns - ev_ns) < llabs(mono_ns - ev_ns)) {
+			ev_ns -= real_ns - mono_ns;
+			ts->tv_sec = ev_ns / 1000000000LL;
+			ts->tv_nsec = ev_ns % 1000000000LL;
+		}
+	}
+
+	return gpiod_line_get_value(f->irqline) == 1;
+}
+
+/* Returns the milliseconds left until the CLOCK_MONOTONIC deadline, rounded
+ * up, 0 if it has passed, or -1 for no deadline (NULL), as for poll().
+ *
+ * Not intended to be called directly
+ */
+static int zpu_ms_left(const struct timespec *deadline)
+{
+	struct timespec now;
+	long long ns;
+
+	if (deadline == NULL) return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+	  (deadline->tv_nsec - now.tv_nsec);
+	if (ns <= 0) return 0;
+
+	return (ns + 999999) / 1000000;
+}
+
+/* Wait for an IRQ until deadline, and consume it.
+ *
+ * Returns 0 on success, -1 with errno set to ETIMEDOUT if the deadline passed
+ * first, or another error.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_irq_wait_until(struct zpu_fifo *f, struct timespec *ts,
+  const struct timespec *deadline)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = f->irqfd;
+	pfd.events = zpu_fifo_irq_events(f);
+	do {
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, zpu_ms_left(deadline));
+		if (ret < 0 && errno != EINTR) return -1;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			return -1;
 		}
+	} while (!(pfd.revents & pfd.events));
+
+	return zpu_fifo_irq_ack(f, ts) < 0 ? -1 : 0;
+}
+
+/* Consume any IRQ left over from earlier FIFO traffic, without blocking, so
+ * that the next wait only returns for a new IRQ.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_irq_clear(struct zpu_fifo *f)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	zpu_irq_wait_until(f, NULL, &now);
+}
+
+/* Returns the current level of the IRQ line without waiting, or -1 on error.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_irq_level(struct zpu_fifo *f)
+{
+	char x = '?';
+
+	if (f->irq_transport) return fpga_irq_level(f->fpga);
+	if (f->irqline != NULL) return gpiod_line_get_value(f->irqline);
+	if (pread(f->irqfd, &x, 1, 0) != 1) return -1;
+
+	return (x == '1');
+}
+
+/* Block until the ZPU raises an IRQ, then consume it. ts is as for
+ * zpu_fifo_irq_ack().
+ *
+ * Returns 0 on success, -1 on error.
+ *
+ * Can be called directly.
+ */
+int zpu_fifo_irq_wait(struct zpu_fifo *f, struct timespec *ts)
+{
+	return zpu_irq_wait_until(f, ts, NULL);
+}
+
+/* Returns the fd that becomes ready when the ZPU raises an IRQ, the same fd
+ * zpu_fifo_init() returned. See zpu_fifo_irq_events(f) for how to wait on it.
+ *
+ * Can be called directly.
+ */
+int zpu_fifo_fd(struct zpu_fifo *f)
+{
+	return f->irqfd;
+}
+
+/* Set deadline to timeout_ms from now, for the *_until() calls
+ *
+ * Can be called directly.
+ */
+void zpu_fifo_deadline(struct timespec *deadline, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
 	}
 }
 
@@ -69,20 +524,25 @@ static void zpu_rx_recalc(int twifd)
  * means that no data output will be lost, but it is possible for the ZPU to
  * stall execution.
  *
- * This function returns the FD of the IRQ, or an error if the IRQ GPIO was
- * unable to be opened.
+ * This function returns a handle to pass to every other FIFO call, or NULL if
+ * the ZPU application is not running or the IRQ GPIO was unable to be opened.
+ * The handle may be shared between threads; each call takes the handle lock
+ * for as long as it touches the FIFO, and MUXBUS commands are serialized so a
+ * reply always goes to the thread that sent the command.
  *
  * Can be called directly.
  */
-int32_t zpu_fifo_init(int twifd, int flow_control)
+struct zpu_fifo *zpu_fifo_init(struct fpga_ctx *fpga, int flow_control)
 {
-	char gpio_buf[64];
-	char x = '?';
+	struct fpga_xfer xfer;
+	struct zpu_fifo *f;
+	uint8_t rxput_raw[3];
+	int i;
 
-	/* Use gpiolib functions to open IRQ, set input, and rising edge trig */
-	gpio_export(FPGA_IRQ);
-	gpio_direction(FPGA_IRQ, 0);
-	gpio_setedge(FPGA_IRQ, 1, 0);
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) return NULL;
+	f->fpga = fpga;
+	f->broker_fd = -1;
 
 	/*
 	 * Set up FIFO link addresses
@@ -93,15 +553,16 @@ int32_t zpu_fifo_init(int twifd, int flow_control)
 	 * 0x3C. Acquire the struct address, byteswap, check it, put it
 	 * in FPGA I2C address context.
 	 */
-	fpeekstream8(twifd, (uint8_t *)&fifo_adr, ZPU_RAM_START + 0x3c,4);
-	fifo_adr = ntohl(fifo_adr);
-	if (fifo_adr == 0 || fifo_adr >= ZPU_RAM_SZ) {
+	fpeekstream8(f->fpga, (uint8_t *)&f->fifo_adr, ZPU_RAM_START + 0x3c,4);
+	f->fifo_adr = ntohl(f->fifo_adr);
+	if (f->fifo_adr == 0 || f->fifo_adr >= ZPU_RAM_SZ) {
 		fprintf(stderr, "ZPU connection refused\n");
 		fprintf(stderr, "Is the ZPU application loaded and running?\n");
-		close(twifd);
-		return -1;
+		free(f);
+		errno = ECONNREFUSED;
+		return NULL;
 	}
-	fifo_adr += ZPU_RAM_START;
+	f->fifo_adr += ZPU_RAM_START;
 
 	/* Now that we have the start of the FIFO struct in the ZPU,
 	 * start getting flags and other data addresses from it.
@@ -115,155 +576,415 @@ int32_t zpu_fifo_init(int twifd, int flow_control)
 	 *   volatile uint32_t rxput;			// RX FIFO head
 	 *   uint32_t rxget;				// RX FIFO tail
 	 *   volatile uint8_t rxdat[ZPU_RXFIFO_SIZE];	// RX buffer
+	 *   volatile uint32_t coalesce;		// TX IRQ coalescing
 	 * } fifo;
+	 *
+	 * The coalesce word is only there if the application sets
+	 * ZPU_COALESCE_OPT in the flags.
 	 */
-	fpeekstream8(twifd, (uint8_t *)&fifo_flags, fifo_adr, 4);
-	fifo_flags = ntohl(fifo_flags);
-	if (flow_control) fifo_flags &= ~(1 << 25);
-	else fifo_flags |= (1 << 25);
-	fpoke8(twifd, fifo_adr, fifo_flags >> 24);
-
-	/* Sanity check
-	 * TX and RX FIFO in the ZPU has an arbitrary limit of 256 bytes.
-	 * Any larger than this and we error under the assumption that the data
-	 * from the the struct is not valid for some reason.
+	fpeekstream8(f->fpga, (uint8_t *)&f->fifo_flags, f->fifo_adr, 4);
+	f->fifo_flags = ntohl(f->fifo_flags);
+	if (flow_control) f->fifo_flags &= ~ZPU_NOFLOW_OPT;
+	else f->fifo_flags |= ZPU_NOFLOW_OPT;
+
+	/* The FIFO sizes are set by the ZPU application, up to ZPU_FIFO_MAX
+	 * each. The cursor addresses point at the low byte of each word, and
+	 * the RX FIFO head follows the TX buffer padded to a word boundary.
+	 *
+	 * Sanity check
+	 * The whole struct has to fit in ZPU RAM, if it does not then we error
+	 * under the assumption that the data from the struct is not valid for
+	 * some reason.
 	 */
-	txfifo_sz = fifo_flags & 0xfff;
-	assert(txfifo_sz <= 256);
-	txfifo_put_adr = fifo_adr + 7;
-	txfifo_get_adr = txfifo_put_adr + 4;
-	txfifo_dat_adr = fifo_adr + 12;
-
-	rxfifo_sz = (fifo_flags >> 12) & 0xfff;
-	assert(rxfifo_sz <= 256);
-	rxfifo_put_adr = txfifo_dat_adr + txfifo_sz + 3;
-	rxfifo_get_adr = rxfifo_put_adr + 4;
-	rxfifo_dat_adr = rxfifo_get_adr + 1;
-
-	/* Get current RX FIFO position.
+	f->txfifo_sz = f->fifo_flags & ZPU_FIFO_MAX;
+	f->txfifo_put_adr = f->fifo_adr + 7;
+	f->txfifo_get_adr = f->txfifo_put_adr + 4;
+	f->txfifo_dat_adr = f->fifo_adr + 12;
+
+	f->rxfifo_sz = (f->fifo_flags >> 12) & ZPU_FIFO_MAX;
+	f->rxfifo_put_adr = f->txfifo_dat_adr + ((f->txfifo_sz + 3) & ~3) + 3;
+	f->rxfifo_get_adr = f->rxfifo_put_adr + 4;
+	f->rxfifo_dat_adr = f->rxfifo_get_adr + 1;
+	if (f->fifo_flags & ZPU_COALESCE_OPT) {
+		f->coalesce_adr = f->rxfifo_dat_adr +
+		  ((f->rxfifo_sz + 3) & ~3);
+	}
+
+	if (f->txfifo_sz < 2 || f->rxfifo_sz < 2 ||
+	  f->rxfifo_dat_adr + f->rxfifo_sz > ZPU_RAM_START + ZPU_RAM_SZ ||
+	  (f->coalesce_adr && f->coalesce_adr + 4 > ZPU_RAM_START + ZPU_RAM_SZ)) {
+		fprintf(stderr, "ZPU FIFO sizes %d/%d are not valid\n",
+		  f->txfifo_sz, f->rxfifo_sz);
+		free(f);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	/* Set the flow control option, turn off any IRQ coalescing left by an
+	 * earlier connection, and get current RX and TX FIFO head positions in
+	 * one transaction, reading the heads again if the ZPU was caught moving
+	 * one.
 	 * Zero out TX FIFO by setting tail to head.
 	 */
-	rxput = fpeek8(twifd, rxfifo_put_adr);
-	txget = txput = fpeek8(twifd, txfifo_put_adr);
-	fpoke8(twifd, txfifo_get_adr, txget);
-	rxfifo_spc = 0;
-	zpu_rx_recalc(twifd);
-
+	fpga_xfer_begin(&xfer, f->fpga);
+	fpga_xfer_poke8(&xfer, f->fifo_adr, f->fifo_flags >> 24);
+	if (f->coalesce_adr) zpu_coalesce_poke(f, &xfer, 0);
+	for (i = 0; i < ZPU_CURSOR_TRIES; i++) {
+		zpu_cursor_peek(&xfer, f->rxfifo_put_adr, f->rxfifo_sz,
+		  rxput_raw);
+		zpu_cursor_peek(&xfer, f->txfifo_put_adr, f->txfifo_sz,
+		  f->txput_raw);
+		if (fpga_xfer_commit(&xfer) == 0 &&
+		  zpu_cursor_val(rxput_raw, f->rxfifo_sz, &f->rxput) == 0 &&
+		  zpu_cursor_val(f->txput_raw, f->txfifo_sz, &f->txput) == 0)
+			break;
+	}
+	if (i == ZPU_CURSOR_TRIES) {
+		fprintf(stderr, "Unable to read ZPU FIFO position\n");
+		free(f);
+		errno = EIO;
+		return NULL;
+	}
+	f->txget = f->txput;
+	zpu_cursor_poke(&xfer, f->txfifo_get_adr, f->txfifo_sz, f->txget);
+	fpga_xfer_commit(&xfer);
+	f->txget_pending = 0;
+	f->txfifo_spec = ZPU_TX_SPEC_MIN;
+	f->spin_avg_ns = ZPU_SPIN_MAX_NS / 4;
+	f->rxfifo_spc = 0;
+	zpu_rx_recalc(f);
 
 	/* ZPU drives the FPGA IRQ line. */
-	snprintf(gpio_buf, sizeof(gpio_buf), "/sys/class/gpio/gpio%d/value",
-	  FPGA_IRQ);
-	irqfd = open(gpio_buf, O_RDONLY);
+	if (zpu_irq_open(f) < 0) {
+		free(f);
+		return NULL;
+	}
 
-	/* Drain the IRQ FD in case there is a spurious IRQ waiting */
-	lseek(irqfd, 0, 0);
-	read(irqfd, &x, 1);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_mutex_init(&f->cmd_lock, NULL);
 
-	return irqfd;
+	return f;
 };
 
 /* This function should be called when disconnecting from the FIFO
  * It simply disables flow control from the ZPU TX FIFO. This allows the ZPU
  * to continue execution and not stall waiting for data to be removed from the
- * FIFO after we're disconnected from it.
+ * FIFO after we're disconnected from it. The handle is freed.
+ *
+ * Can be called directly.
+ */
+void zpu_fifo_deinit(struct zpu_fifo *f)
+{
+	struct fpga_xfer xfer;
+
+	if (f->broker_fd >= 0) {
+		close(f->broker_fd);
+		goto out;
+	}
+
+	pthread_mutex_lock(&f->lock);
+	f->fifo_flags |= ZPU_NOFLOW_OPT;
+	fpga_xfer_begin(&xfer, f->fpga);
+	zpu_tx_ack(f, &xfer);
+	fpga_xfer_poke8(&xfer, f->fifo_adr, f->fifo_flags >> 24);
+	if (f->coalesce_adr) zpu_coalesce_poke(f, &xfer, 0);
+	fpga_xfer_commit(&xfer);
+	if (f->irqline != NULL) {
+		gpiod_line_release(f->irqline);
+		gpiod_chip_close(f->irqchip);
+		f->irqline = NULL;
+		f->irqchip = NULL;
+	} else if (!f->irq_transport) {
+		close(f->irqfd);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+out:
+	pthread_mutex_destroy(&f->lock);
+	pthread_mutex_destroy(&f->cmd_lock);
+	free(f);
+}
+
+/* Set up IRQ coalescing in the ZPU application. Rather than raising the IRQ
+ * each time data is put in the TX FIFO, the ZPU holds it back until the TX
+ * FIFO holds at least bytes, or the oldest data not signalled has waited for
+ * timeout_us. Either may be 0 to leave it out, and both 0 restores an IRQ for
+ * every put. A full TX FIFO and an explicit fifo_raise_irq0() in the ZPU
+ * always raise the IRQ straight away.
+ *
+ * The timeout is counted in the ZPU in units of 1024 FPGA clocks, about 16 us,
+ * up to about 1 second, and is only checked while the ZPU application is
+ * using the FIFO, see fifo_poll() in zpu/fifo.c. Coalescing is turned off
+ * again by zpu_fifo_deinit().
+ *
+ * Returns 0 on success, or -1 with errno set to ENOTSUP if the ZPU application
+ * does not support coalescing, or EIO if the write failed.
+ *
+ * Can be called directly.
+ */
+int zpu_fifo_set_coalesce(struct zpu_fifo *f, unsigned int bytes,
+  unsigned int timeout_us)
+{
+	struct fpga_xfer xfer;
+	unsigned long long units;
+	int ret;
+
+	if (f->broker_fd >= 0 || f->coalesce_adr == 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	units = ((unsigned long long)timeout_us * ZPU_CLK_MHZ + 1023) / 1024;
+	if (units > 0xffff) units = 0xffff;
+	if (bytes > 0xffff) bytes = 0xffff;
+
+	pthread_mutex_lock(&f->lock);
+	fpga_xfer_begin(&xfer, f->fpga);
+	zpu_coalesce_poke(f, &xfer, units << 16 | bytes);
+	ret = fpga_xfer_commit(&xfer);
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Connect to a running tszpubroker, which owns the ZPU FIFO on behalf of any
+ * number of clients. path is the broker socket, or NULL for the ZPU_BROKER
+ * environment variable, or ZPU_BROKER_PATH if that is not set.
+ *
+ * The handle returned is used as one from zpu_fifo_init(), but only for the
+ * zpu_muxbus_* calls, zpu_fifo_stats_print() and zpu_fifo_deinit(). Returns
+ * NULL with errno set if there is no broker running.
  *
  * Can be called directly.
  */
-void zpu_fifo_deinit(int twifd)
+struct zpu_fifo *zpu_broker_connect(const char *path)
 {
-	fifo_flags |= (1<<25);
-	fpoke8(twifd, fifo_adr, fifo_flags >> 24);
-	close(irqfd);
+	struct sockaddr_un sun;
+	struct zpu_fifo *f;
+
+	if (path == NULL) path = getenv("ZPU_BROKER");
+	if (path == NULL) path = ZPU_BROKER_PATH;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) return NULL;
+	f->irqfd = -1;
+
+	f->broker_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (f->broker_fd < 0) {
+		free(f);
+		return NULL;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(f->broker_fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		close(f->broker_fd);
+		free(f);
+		return NULL;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_mutex_init(&f->cmd_lock, NULL);
+
+	return f;
 }
 
 /* The get and put functions are named from the CPU perspective, while variables
  * inside of them are named from the ZPU perspective.
  */
 
-/* This function will read from ZPU FIFO, to buf, up to max size.
- * FIFO will be read until size bytes have been read, or until the FIFO is empty
+/* Drain the ZPU TX FIFO in to the caller's iovec, starting skip bytes in to
+ * it.
  *
- * Passing a buffer larger than 256 bytes (the standard FIFO size) is not useful
- * or recommended.
+ * Returns the number of bytes read, 0 if the FIFO is empty, or -1 with errno
+ * set to EIO if the transaction failed. Bytes of the iovec past the returned
+ * count may be overwritten.
  *
- * This function returns the number of bytes actually read from the FIFO.
+ * Not intended to be called directly
  */
-size_t zpu_fifo_get(int twifd, uint8_t *buf, size_t size)
+static ssize_t zpu_tx_drainv(struct zpu_fifo *f, const struct iovec *iov,
+  int iovcnt, size_t skip)
 {
-	int rdsz0 = 0, rdsz = 0;
+	struct zpu_drain_seg seg[ZPU_DRAIN_SEGS];
+	size_t rdsz, left, len, n, avail;
+	struct fpga_xfer xfer;
+	int pending = f->txget_pending;
+	uint16_t pos;
+	uint8_t *buf;
+	int i, j, nseg = 0;
 
-	assert(buf != NULL);
+	assert(f->broker_fd < 0);
 
 	/* ZPU sending data to host
 	 *
-	 * Get the current TX FIFO head
+	 * The whole drain is a single I2C transaction. Any tail position owed
+	 * to the ZPU from the last drain is written first, then the TX FIFO
+	 * head is read, then the ring is read speculatively from the tail,
+	 * before it is known how much of it is valid. Since the ZPU always
+	 * fills data in before moving the head, every byte up to the head read
+	 * at the start of the transaction is valid by the time it is read.
 	 *
-	 * If head pos. is behind the tail pos., then host will pull data out
-	 * through the end of the FIFO in one contiguous chunk. rdsz0 is used
-	 * in this case as an offset for later calculating the full count.
+	 * The speculative read goes straight in to the caller's buffers. It is
+	 * split where it wraps past the end of the ring and where one iovec
+	 * entry ends and the next begins. Its length tracks how much data was
+	 * waiting on the last drain, so small replies cost little bus time and
+	 * bulk transfers are read a whole FIFO at a time.
 	 *
-	 * Host pull out data from the tail through the current head.
-	 *
-	 * Update ZPU RAM and our local var with new tail pos.
+	 * Reading the head also clears the IRQ from the ZPU. If the ZPU was
+	 * caught moving the head, nothing read can be trusted and the whole
+	 * drain is done again.
 	 */
-	txput = fpeek8(twifd, txfifo_put_adr);
-	if (txput != txget) {
-		if (txput < txget) { 
-			rdsz0 = txfifo_sz - txget;
-			if (size < rdsz0) rdsz0 = size;
-			fpeekstream8(twifd, buf,
-			  txfifo_dat_adr + txget, rdsz0);
-			size = size - rdsz0;
-			txget = txget + rdsz0;
+	left = f->txfifo_spec;
+	if (left > f->txfifo_sz - 1U) left = f->txfifo_sz - 1;
+	rdsz = left;
+	pos = f->txget;
+	for (i = 0; i < iovcnt && left && nseg < ZPU_DRAIN_SEGS; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		buf = (uint8_t *)iov[i].iov_base + skip;
+		len = iov[i].iov_len - skip;
+		skip = 0;
+		while (len && left && nseg < ZPU_DRAIN_SEGS) {
+			n = f->txfifo_sz - pos;
+			if (n > len) n = len;
+			if (n > left) n = left;
+			seg[nseg].buf = buf;
+			seg[nseg].pos = pos;
+			seg[nseg].len = n;
+			nseg++;
+			buf += n;
+			len -= n;
+			left -= n;
+			pos = (pos + n) % f->txfifo_sz;
 		}
+	}
+	rdsz -= left;
 
-		/* Skip the following if head still behind tail.
-		 * This would mean that, above, size was smaller than the
-		 * distance between the tail and the end of the FIFO buffer
-		 * and we don't need to keep grabbing data.
-		 * Otherwise, keep trying to pull more data from FIFO.
-		 */
-		if (!(txput < txget)) {
-			rdsz = txput - txget;
-			if (size < rdsz) rdsz = size;
-			if (rdsz) {
-				fpeekstream8(twifd, buf + rdsz0,
-				  txfifo_dat_adr + txget, rdsz);
-				txget = txget + rdsz;
-			}
+	fpga_xfer_begin(&xfer, f->fpga);
+	for (i = 0; i < ZPU_CURSOR_TRIES; i++) {
+		zpu_tx_ack(f, &xfer);
+		zpu_cursor_peek(&xfer, f->txfifo_put_adr, f->txfifo_sz,
+		  f->txput_raw);
+		for (j = 0; j < nseg; j++) {
+			fpga_xfer_peekstream8(&xfer, seg[j].buf,
+			  f->txfifo_dat_adr + seg[j].pos, seg[j].len);
+		}
+		if (fpga_xfer_commit(&xfer)) {
+			i = ZPU_CURSOR_TRIES;
+			break;
 		}
+		if (zpu_cursor_val(f->txput_raw, f->txfifo_sz, &f->txput) == 0)
+			break;
+	}
+	if (i == ZPU_CURSOR_TRIES) {
+		f->txget_pending = pending;
+		errno = EIO;
+		return -1;
+	}
+
+	if (f->txput >= f->txget) avail = f->txput - f->txget;
+	else avail = f->txfifo_sz - f->txget + f->txput;
 
-		rdsz += rdsz0;
-		fpoke8(twifd, txfifo_get_adr, txget); 
+	f->txfifo_spec = avail;
+	if (f->txfifo_spec < ZPU_TX_SPEC_MIN) f->txfifo_spec = ZPU_TX_SPEC_MIN;
+
+	if (rdsz > avail) rdsz = avail;
+	if (rdsz) {
+		f->txget = (f->txget + rdsz) % f->txfifo_sz;
+		f->txget_pending = 1;
+
+		/* With flow control, a full FIFO means the ZPU is stalled
+		 * waiting for space, so it can't wait for the next request */
+		if (avail == f->txfifo_sz - 1U) {
+			fpga_xfer_begin(&xfer, f->fpga);
+			zpu_tx_ack(f, &xfer);
+			fpga_xfer_commit(&xfer);
+		}
 	}
 
-	/* Should never encounter a situation where no bytes were read and
-	 * FIFO head and tail are not the same position.
-	 */
-	if (rdsz == 0 && txput != txget) assert(0);
 	return rdsz;
 }
 
-/* This function will write to ZPU FIFO, from buf, up to max size.
- * The FIFO will be writen until size bytes have been placed in the FIFO, or
- * until the FIFO is full.
- *
- * Passing a buffer larger than 16 bytes (the standard FIFO size) is not useful
- * or recommended.
+/* Drain up to size bytes from the ZPU TX FIFO in to buf, see zpu_tx_drainv()
  *
- * This function returns the number of bytes actually written to the FIFO.
+ * Not intended to be called directly
  */
-size_t zpu_fifo_put(int twifd, uint8_t *buf, size_t size)
+static ssize_t zpu_tx_drain(struct zpu_fifo *f, uint8_t *buf, size_t size)
 {
-	size_t wrsz = 0;
+	struct iovec iov;
 
 	assert(buf != NULL);
 
-	/* ZPU recv. data from host
-	 *
-	 * If the RX buffer has free space and the head is less than size bytes
-	 * from the largest FIFO position, write data to the end of the FIFO.
-	 *
+	iov.iov_base = buf;
+	iov.iov_len = size;
+
+	return zpu_tx_drainv(f, &iov, 1, 0);
+}
+
+/* True if the head read by the last drain was past the tail it left, i.e. the
+ * ZPU had more data waiting than the drain could take.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_tx_more(struct zpu_fifo *f)
+{
+	return f->txput != f->txget;
+}
+
+/* This function will read from ZPU FIFO, to buf, up to max size.
+ * FIFO will be read until size bytes have been read, or until the FIFO is empty
+ *
+ * Passing a buffer larger than the ZPU TX FIFO (256 bytes in the standard ZPU
+ * applications) is not useful or recommended. Bytes of buf past the returned
+ * count may be overwritten.
+ *
+ * This function returns the number of bytes actually read from the FIFO.
+ */
+size_t zpu_fifo_get(struct zpu_fifo *f, uint8_t *buf, size_t size)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&f->lock);
+	ret = zpu_tx_drain(f, buf, size);
+	pthread_mutex_unlock(&f->lock);
+
+	return ret < 0 ? 0 : ret;
+}
+
+/* Fill up to size bytes from buf in to the ZPU RX FIFO.
+ *
+ * Returns the number of bytes written, 0 if the FIFO is full, or -1 with
+ * errno set to EIO if the transaction failed.
+ *
+ * Not intended to be called directly
+ */
+static ssize_t zpu_rx_fill(struct zpu_fifo *f, uint8_t *buf, size_t size)
+{
+	size_t wrsz = 0;
+	struct fpga_xfer xfer;
+	uint16_t rxput_old = f->rxput;
+	int pending = f->txget_pending;
+
+	assert(buf != NULL);
+	assert(f->broker_fd < 0);
+
+	/* ZPU recv. data from host
+	 *
+	 * If the RX buffer has free space and the head is less than size bytes
+	 * from the largest FIFO position, write data to the end of the FIFO.
+	 *
 	 * If the RX buffer has free space and the head is more than size bytes
 	 * from the largest FIFO position, write data until size.
 	 *
@@ -271,39 +992,399 @@ size_t zpu_fifo_put(int twifd, uint8_t *buf, size_t size)
 	 * amount of free space is known with rxfifo_spc, we never write more
 	 * than that.
 	 *
-	 * Recalculate the amount of free space in the RX FIFO.
-	 * Update RX FIFO head in ZPU RAM space.
+	 * rxfifo_spc is a credit of space known to be free. It only shrinks
+	 * as data is written, and is topped up by the ZPU tail read at the end
+	 * of every write. The ZPU tail is only read on its own when the credit
+	 * can't cover the whole write, so in the common case a put, including
+	 * a complete MUXBUS command, is a single I2C transaction.
+	 *
+	 * Update RX FIFO head in ZPU RAM space. The data, the head update, any
+	 * TX FIFO tail owed to the ZPU from the last drain, and the read of
+	 * the RX FIFO tail are issued to the FPGA as a single I2C transaction.
 	 */
-	if (size > rxfifo_spc) size = rxfifo_spc;
+	if (size > ZPU_RX_FILL_MAX) size = ZPU_RX_FILL_MAX;
+	if (size > f->rxfifo_spc) zpu_rx_recalc(f);
+	if (size > f->rxfifo_spc) size = f->rxfifo_spc;
 	if (size > 0) {
+		fpga_xfer_begin(&xfer, f->fpga);
+		zpu_tx_ack(f, &xfer);
 
-		if ((rxput + size) > rxfifo_sz) {
-			wrsz = rxfifo_sz - rxput;
-			fpokestream8(twifd, buf, rxfifo_dat_adr + rxput,
-			 wrsz);
-			rxput = rxput + wrsz;
-			assert(rxput <= rxfifo_sz);
-			if (rxput == rxfifo_sz) rxput = 0;
+		if ((f->rxput + size) > f->rxfifo_sz) {
+			wrsz = f->rxfifo_sz - f->rxput;
+			fpga_xfer_pokestream8(&xfer, buf,
+			  f->rxfifo_dat_adr + f->rxput, wrsz);
+			f->rxput = f->rxput + wrsz;
+			assert(f->rxput <= f->rxfifo_sz);
+			if (f->rxput == f->rxfifo_sz) f->rxput = 0;
 			size = size - wrsz;
 		}
 
 		if (size > 0) {
-			fpokestream8(twifd, buf + wrsz, rxfifo_dat_adr + rxput,
-			  size);
-			rxput = rxput + size;
-			assert(rxput <= rxfifo_sz);
-			if (rxput == rxfifo_sz) rxput = 0;
+			fpga_xfer_pokestream8(&xfer, buf + wrsz,
+			  f->rxfifo_dat_adr + f->rxput, size);
+			f->rxput = f->rxput + size;
+			assert(f->rxput <= f->rxfifo_sz);
+			if (f->rxput == f->rxfifo_sz) f->rxput = 0;
 			wrsz = wrsz + size;
 		}
-		rxfifo_spc = rxfifo_spc - wrsz;
-		fpoke8(twifd, rxfifo_put_adr, rxput);
+		f->rxfifo_spc = f->rxfifo_spc - wrsz;
+		zpu_cursor_poke(&xfer, f->rxfifo_put_adr, f->rxfifo_sz,
+		  f->rxput);
+		zpu_cursor_peek(&xfer, f->rxfifo_get_adr, f->rxfifo_sz,
+		  f->rxget_raw);
+		if (fpga_xfer_commit(&xfer)) {
+			f->rxput = rxput_old;
+			f->rxfifo_spc = f->rxfifo_spc + wrsz;
+			f->txget_pending = pending;
+			errno = EIO;
+			return -1;
+		}
+		/* A tail caught mid update only costs credit until next time */
+		zpu_cursor_val(f->rxget_raw, f->rxfifo_sz, &f->rxget);
+		zpu_rx_space(f);
+	}
+
+	return wrsz;
+}
+
+/* This function will write to ZPU FIFO, from buf, up to max size.
+ * The FIFO will be writen until size bytes have been placed in the FIFO, or
+ * until the FIFO is full.
+ *
+ * Passing a buffer larger than the ZPU RX FIFO (16 bytes in the standard ZPU
+ * applications) is not useful or recommended.
+ *
+ * This function returns the number of bytes actually written to the FIFO.
+ */
+size_t zpu_fifo_put(struct zpu_fifo *f, uint8_t *buf, size_t size)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&f->lock);
+	ret = zpu_rx_fill(f, buf, size);
+	pthread_mutex_unlock(&f->lock);
+
+	return ret < 0 ? 0 : ret;
+}
+
+/* Nonblocking and deadline calls
+ *
+ * These follow read()/write() conventions so they fit in to event loops. The
+ * *_nb() calls never wait, and fail with EAGAIN when the FIFO is empty or
+ * full. The *_until() calls wait until an absolute CLOCK_MONOTONIC deadline,
+ * see zpu_fifo_deadline(), or forever if deadline is NULL, and fail with
+ * ETIMEDOUT if nothing could be done by then. A failed transaction fails
+ * with EIO.
+ *
+ * To multiplex the ZPU with other fds, wait on zpu_fifo_fd() for the events
+ * in zpu_fifo_irq_events(f). When it is ready, call zpu_fifo_irq_ack() and then
+ * zpu_fifo_get_nb() until EAGAIN. The fd is level triggered, so it may also
+ * be used with epoll. There is no event for RX FIFO space, a put that fails
+ * with EAGAIN should be retried from a timer.
+ */
+
+/* Read from the ZPU FIFO straight in to the iovcnt buffers of iov, in order,
+ * until they are full or the FIFO is empty. A drain that wraps the end of the
+ * ring is read as two segments in to the buffers, with no bounce buffer in
+ * between, and there is no limit on the total size other than the buffers.
+ * Bytes past the returned count may be overwritten.
+ *
+ * Returns the number of bytes read, 0 if the FIFO was empty, or -1 with errno
+ * set if the first drain failed.
+ *
+ * Can be called directly.
+ */
+ssize_t zpu_fifo_readv(struct zpu_fifo *f, const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0, size = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) size += iov[i].iov_len;
+
+	pthread_mutex_lock(&f->lock);
+	do {
+		ret = zpu_tx_drainv(f, iov, iovcnt, total);
+		if (ret > 0) total += ret;
+	} while (ret > 0 && total < size && zpu_tx_more(f));
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret < 0 && total == 0) return -1;
+
+	return total;
+}
+
+/* Read from the ZPU FIFO until it is empty, max bytes have been read, or cb
+ * returns nonzero, passing the data to cb as it arrives. Each drain of the
+ * ring is passed as one or two calls, split where the ring wraps. The data
+ * passed is only valid until cb returns. cb is called with the handle locked
+ * and must not call back in to this handle.
+ *
+ * Returns the number of bytes passed to cb, 0 if the FIFO was empty, or -1
+ * with errno set if the first drain failed.
+ *
+ * Can be called directly.
+ */
+ssize_t zpu_fifo_get_cb(struct zpu_fifo *f, size_t max, zpu_fifo_cb cb,
+  void *arg)
+{
+	struct iovec iov[2];
+	size_t total = 0, n;
+	ssize_t ret;
+	uint16_t pos;
+	int stop = 0;
+
+	assert(cb != NULL);
+
+	pthread_mutex_lock(&f->lock);
+	do {
+		/* Each byte lands at its own ring position in the mirror */
+		pos = f->txget;
+		iov[0].iov_base = f->txmirror + pos;
+		iov[0].iov_len = f->txfifo_sz - pos;
+		iov[1].iov_base = f->txmirror;
+		iov[1].iov_len = pos;
+		if (iov[0].iov_len > max - total) {
+			iov[0].iov_len = max - total;
+			iov[1].iov_len = 0;
+		} else if (iov[1].iov_len > max - total - iov[0].iov_len) {
+			iov[1].iov_len = max - total - iov[0].iov_len;
+		}
+
+		ret = zpu_tx_drainv(f, iov, 2, 0);
+		if (ret <= 0) break;
+		total += ret;
+
+		n = (size_t)ret < iov[0].iov_len ? (size_t)ret : iov[0].iov_len;
+		stop = cb(arg, f->txmirror + pos, n);
+		if (!stop && (size_t)ret > n)
+			stop = cb(arg, f->txmirror, ret - n);
+	} while (!stop && total < max && zpu_tx_more(f));
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret < 0 && total == 0) return -1;
+
+	return total;
+}
+
+/* Read up to size bytes. Returns the number read, or -1 with errno set.
+ *
+ * Can be called directly.
+ */
+ssize_t zpu_fifo_get_nb(struct zpu_fifo *f, uint8_t *buf, size_t size)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&f->lock);
+	ret = zpu_tx_drain(f, buf, size);
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret == 0 && size > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Write up to size bytes. Returns the number written, or -1 with errno set.
+ *
+ * Can be called directly.
+ */
+ssize_t zpu_fifo_put_nb(struct zpu_fifo *f, uint8_t *buf, size_t size)
+{
+	ssize_t ret;
+
+	pthread_mutex_lock(&f->lock);
+	ret = zpu_rx_fill(f, buf, size);
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret == 0 && size > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Read up to size bytes, waiting for the ZPU IRQ until deadline if the FIFO
+ * is empty. Returns as soon as any data has been read.
+ *
+ * Returns the number of bytes read, or -1 with errno set.
+ *
+ * Can be called directly.
+ */
+ssize_t zpu_fifo_get_until(struct zpu_fifo *f, uint8_t *buf, size_t size,
+  const struct timespec *deadline)
+{
+	ssize_t ret;
+
+	while (1) {
+		ret = zpu_fifo_get_nb(f, buf, size);
+		if (ret >= 0 || errno != EAGAIN) return ret;
+		if (zpu_irq_wait_until(f, NULL, deadline)) return -1;
+	}
+}
+
+/* Write all size bytes, waiting for RX FIFO space until deadline. The ZPU
+ * does not signal when it frees space, so the RX FIFO is rechecked every
+ * ZPU_RX_RETRY_US while waiting.
+ *
+ * Returns size, a short count if the deadline passed part way, or -1 with
+ * errno set if nothing was written.
+ *
+ * Can be called directly.
+ */
+#define ZPU_RX_RETRY_US	200
+ssize_t zpu_fifo_put_until(struct zpu_fifo *f, uint8_t *buf, size_t size,
+  const struct timespec *deadline)
+{
+	size_t wrsz = 0;
+	ssize_t ret;
+	int left;
+
+	while (wrsz < size) {
+		ret = zpu_fifo_put_nb(f, buf + wrsz, size - wrsz);
+		if (ret > 0) {
+			wrsz += ret;
+			continue;
+		}
+		if (errno != EAGAIN) break;
+
+		left = zpu_ms_left(deadline);
+		if (left == 0) {
+			errno = ETIMEDOUT;
+			break;
+		}
+		usleep(ZPU_RX_RETRY_US);
 	}
-	zpu_rx_recalc(twifd);
 
+	if (wrsz == 0 && size > 0) return -1;
 	return wrsz;
 }
 
 
+/* Hybrid completion wait
+ *
+ * Most ZPU operations complete within microseconds of the command reaching the
+ * ZPU, much sooner than the IRQ can wake this process. So the completion is
+ * first polled for, over a window of twice the running average completion
+ * time, before falling back to waiting on the IRQ fd. A reply is polled for by
+ * draining the TX FIFO, which reads the TX FIFO head over I2C. The ZPU signals
+ * a completion without a reply with only the IRQ, so that is polled for by
+ * reading the IRQ line level.
+ *
+ * Operations that take longer than ZPU_SPIN_MAX_NS on average go straight to
+ * the IRQ, with a polled probe every ZPU_SPIN_PROBE operations so the average
+ * follows the ZPU if it speeds back up. The path that completed each operation
+ * is counted, see zpu_fifo_stats_print().
+ */
+
+/* Returns ts in ns
+ *
+ * Not intended to be called directly
+ */
+static long long zpu_ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Fold the completion time of an operation started at t0 in to the average
+ *
+ * Not intended to be called directly
+ */
+static void zpu_spin_sample(struct zpu_fifo *f, const struct timespec *t0,
+  const struct timespec *done)
+{
+	long long ns = zpu_ts_ns(done) - zpu_ts_ns(t0);
+
+	if (ns < 0) ns = 0;
+	f->spin_avg_ns += (ns - f->spin_avg_ns) / 8;
+}
+
+/* Wait for the completion of an operation sent to the ZPU at t0, until
+ * deadline. If size is nonzero, the operation replies with data and up to size
+ * bytes of it are read in to buf. If size is 0, the completion is only
+ * signaled by the IRQ, which is left asserted for the caller to clear.
+ *
+ * Returns the number of bytes read, 0 for a completion without a reply, or -1
+ * with errno set.
+ *
+ * Not intended to be called directly
+ */
+static ssize_t zpu_done_wait(struct zpu_fifo *f, uint8_t *buf, size_t size,
+  const struct timespec *t0, const struct timespec *deadline)
+{
+	struct timespec now;
+	long long window;
+	ssize_t ret;
+
+	window = f->spin_avg_ns * 2;
+	if (window > ZPU_SPIN_MAX_NS) {
+		window = 0;
+		if (++f->spin_skip >= ZPU_SPIN_PROBE) {
+			f->spin_skip = 0;
+			window = ZPU_SPIN_MAX_NS;
+		}
+	}
+
+	while (window) {
+		if (size) {
+			ret = zpu_fifo_get_nb(f, buf, size);
+			if (ret < 0 && errno != EAGAIN) return -1;
+		} else {
+			ret = zpu_irq_level(f);
+			if (ret < 0) return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ret > 0) {
+			f->spin_done++;
+			zpu_spin_sample(f, t0, &now);
+			return size ? ret : 0;
+		}
+		if (zpu_ms_left(deadline) == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (zpu_ts_ns(&now) - zpu_ts_ns(t0) >= window) break;
+	}
+
+	/* The edge of an IRQ raised while polling is still queued */
+	while (1) {
+		if (zpu_irq_wait_until(f, &now, deadline)) return -1;
+		if (size == 0) {
+			ret = 0;
+			break;
+		}
+		ret = zpu_fifo_get_nb(f, buf, size);
+		if (ret > 0) break;
+		if (errno != EAGAIN) return -1;
+	}
+	f->irq_done++;
+	zpu_spin_sample(f, t0, &now);
+
+	return ret;
+}
+
+/* Print how ZPU operations completed as key=value lines, see zpu_done_wait()
+ *
+ * Can be called directly.
+ */
+void zpu_fifo_stats_print(struct zpu_fifo *f, FILE *out)
+{
+	pthread_mutex_lock(&f->cmd_lock);
+	if (f->broker_fd >= 0) {
+		fprintf(out, "zpu_broker_requests=%u\n", f->broker_seq);
+		pthread_mutex_unlock(&f->cmd_lock);
+		return;
+	}
+	fprintf(out, "zpu_done_polled=%lu\n", f->spin_done);
+	fprintf(out, "zpu_done_irq=%lu\n", f->irq_done);
+	fprintf(out, "zpu_done_avg_ns=%lld\n", f->spin_avg_ns);
+	pthread_mutex_unlock(&f->cmd_lock);
+}
+
+
 /* MUXBUS specific functions
  *
  * The following functions are simple abstractions for use with the MUXBUX
@@ -316,64 +1397,375 @@ size_t zpu_fifo_put(int twifd, uint8_t *buf, size_t size)
 #define MB_16BIT	(1 << 1)
 #define MB_8BIT		(0 << 1)
 
+/* Default timeout for the MUXBUS calls without a deadline */
+#define ZPU_MUXBUS_TIMEOUT_MS	1000
+
+/* Send a whole MUXBUS command, then wait for the ZPU to complete it and read
+ * back len bytes of reply in to dat. For a write, the IRQ alone signals
+ * completion and len is 0.
+ *
+ * The deadline can only stop the command before any of it is sent, or while
+ * waiting for the reply. Keep cmd within the RX FIFO so that it is sent in
+ * one go.
+ *
+ * Returns 0 on success, or -1 with errno set. errno is EIO if the command
+ * could not be sent whole, from then on until the handle is closed.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_muxbus_cmd(struct zpu_fifo *f, uint8_t *cmd, size_t cmdlen,
+  uint8_t *dat, size_t len, const struct timespec *deadline)
+{
+	uint8_t dummy[2];
+	struct timespec t0, grace;
+	size_t sent, rdsz = 0;
+	ssize_t ret;
+	int err = -1;
+
+	pthread_mutex_lock(&f->cmd_lock);
+	if (f->muxbus_desync) {
+		errno = EIO;
+		goto out;
+	}
+	zpu_irq_clear(f);
+	/* A write is polled for by the IRQ level, which an earlier command that
+	 * timed out may have left asserted */
+	if (len == 0 && zpu_irq_level(f) == 1)
+		zpu_fifo_get(f, dummy, sizeof(dummy));
+	ret = zpu_fifo_put_until(f, cmd, cmdlen, deadline);
+	if (ret < 0) goto out;
+
+	/* Once any of it is in the ZPU the rest must follow, or the ZPU would
+	 * take the start of the next command as the rest of this one. So the
+	 * deadline is not held to here, only a ZPU that stopped taking data
+	 * gives up, and leaves the handle unusable. */
+	sent = ret;
+	if (sent != cmdlen) {
+		zpu_fifo_deadline(&grace, ZPU_MUXBUS_TIMEOUT_MS);
+		ret = zpu_fifo_put_until(f, cmd + sent, cmdlen - sent, &grace);
+		if (ret < 0 || sent + ret != cmdlen) {
+			f->muxbus_desync = 1;
+			errno = EIO;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = zpu_done_wait(f, dat, len, &t0, deadline);
+	if (ret < 0) goto out;
+
+	if (len == 0) {
+		/* Read required to clear IRQ from ZPU side */
+		zpu_fifo_get(f, dummy, sizeof(dummy));
+		err = 0;
+		goto out;
+	}
+
+	rdsz = ret;
+	while (rdsz < len) {
+		ret = zpu_fifo_get_until(f, dat + rdsz, len - rdsz,
+		  deadline);
+		if (ret < 0) goto out;
+		rdsz += ret;
+	}
+	err = 0;
+
+out:
+	pthread_mutex_unlock(&f->cmd_lock);
+	return err;
+}
+
+/* Encode op as a MUXBUS command in to buf, returning its length
+ *
+ * Not intended to be called directly
+ */
+static size_t zpu_muxbus_encode(const struct zpu_muxbus_op *op, uint8_t *buf)
+{
+	if (op->count) {
+		buf[0] = (MB_READ | MB_16BIT | ((op->count - 1) << 2));
+		buf[1] = (op->adr >> 8) & 0xFF;
+		buf[2] = (op->adr & 0xFF);
+		return 3;
+	}
+
+	buf[0] = (MB_WRITE | MB_16BIT);
+	buf[1] = (op->adr >> 8) & 0xFF;
+	buf[2] = (op->adr & 0xFF);
+	buf[3] = (op->dat >> 8) & 0xFF;
+	buf[4] = (op->dat & 0xFF);
+	return 5;
+}
+
+/* Send up to ZPU_BROKER_MAX_OPS of a batch to tszpubroker and wait for the
+ * reply. Replies to an earlier request that timed out are discarded.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_broker_batch(struct zpu_fifo *f, struct zpu_muxbus_op *ops,
+  int nops, const struct timespec *deadline)
+{
+	struct zpu_broker_req req;
+	struct zpu_broker_rep rep;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t ret;
+	int i, ms, err = -1;
+
+	assert(nops <= ZPU_BROKER_MAX_OPS);
+
+	memset(&req, 0, sizeof(req));
+	req.nops = nops;
+	for (i = 0; i < nops; i++) {
+		req.ops[i].adr = ops[i].adr;
+		req.ops[i].dat = ops[i].dat;
+		req.ops[i].count = ops[i].count;
+		len += ops[i].count * 2;
+	}
+
+	pthread_mutex_lock(&f->cmd_lock);
+	req.seq = ++f->broker_seq;
+	req.timeout_ms = zpu_ms_left(deadline);
+	ret = send(f->broker_fd, &req,
+	  offsetof(struct zpu_broker_req, ops[nops]), MSG_NOSIGNAL);
+	if (ret < 0) goto out;
+
+	pfd.fd = f->broker_fd;
+	pfd.events = POLLIN;
+	while (1) {
+		/* The broker gives up at the deadline, allow it time to say so */
+		ms = zpu_ms_left(deadline);
+		if (ms >= 0) ms += ZPU_MUXBUS_TIMEOUT_MS;
+		ret = poll(&pfd, 1, ms);
+		if (ret < 0 && errno == EINTR) continue;
+		if (ret < 0) goto out;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			goto out;
+		}
+
+		ret = recv(f->broker_fd, &rep, sizeof(rep), 0);
+		if (ret < 0) goto out;
+		if (ret == 0) {
+			errno = EPIPE;
+			goto out;
+		}
+		if (ret >= (ssize_t)offsetof(struct zpu_broker_rep, dat) &&
+		  rep.seq == req.seq)
+			break;
+	}
+
+	if (rep.err) {
+		errno = rep.err;
+		goto out;
+	}
+	if (ret != (ssize_t)(offsetof(struct zpu_broker_rep, dat) + len)) {
+		errno = EPROTO;
+		goto out;
+	}
+
+	len = 0;
+	for (i = 0; i < nops; i++) {
+		memcpy(ops[i].buf, rep.dat + len, ops[i].count * 2);
+		len += ops[i].count * 2;
+	}
+	err = 0;
+
+out:
+	pthread_mutex_unlock(&f->cmd_lock);
+	return err;
+}
+
+/* Largest run of batched MUXBUS commands sent to the ZPU at once */
+#define ZPU_MUXBUS_BATCH_CMD	256
+
+/* Run nops MUXBUS accesses in order, with a deadline
+ *
+ * The accesses are sent to the ZPU in as few FIFO transfers as possible. Each
+ * run of accesses that ends with a read is sent together, and is complete
+ * once the last read data arrives, as the ZPU works through commands in order.
+ * A run is kept short enough that its commands fit in the ZPU RX FIFO and its
+ * replies in the TX FIFO, and the deadline is only checked between runs, so a
+ * timeout never leaves part of a command in the ZPU. Writes after the last
+ * read are each waited for by the IRQ, as zpu_muxbus_poke16() does.
+ *
+ * On a handle from zpu_broker_connect(), the batch is sent to the broker,
+ * which may batch it further with those of other clients.
+ *
+ * Returns 0 when every access is complete, or -1 with errno set to
+ * ETIMEDOUT if they did not complete by the deadline, or EIO if the ZPU stopped
+ * taking a command part way. On an error, some of the accesses may have been
+ * done.
+ */
+int zpu_muxbus_batch_until(struct zpu_fifo *f, struct zpu_muxbus_op *ops,
+  int nops, const struct timespec *deadline)
+{
+	uint8_t cmd[ZPU_MUXBUS_BATCH_CMD], reply[ZPU_FIFO_MAX];
+	size_t cmdlen, replylen, cmdmax, n;
+	int i, j, last;
+
+	for (i = 0; i < nops; i++) {
+		/* Ensure that count never exceeds 64 */
+		assert(ops[i].count <= 64);
+		assert(ops[i].count == 0 || ops[i].buf != NULL);
+	}
+
+	if (f->broker_fd >= 0) {
+		for (i = 0; i < nops; i += ZPU_BROKER_MAX_OPS) {
+			n = nops - i;
+			if (n > ZPU_BROKER_MAX_OPS) n = ZPU_BROKER_MAX_OPS;
+			if (zpu_broker_batch(f, ops + i, n, deadline))
+				return -1;
+		}
+		return 0;
+	}
+
+	/* A run is held to what the RX FIFO takes at once, so each is sent
+	 * whole, and the deadline is checked between runs */
+	cmdmax = f->rxfifo_sz - 1U;
+	if (cmdmax > sizeof(cmd)) cmdmax = sizeof(cmd);
+
+	i = 0;
+	while (i < nops) {
+		/* Find the longest run from i that fits and ends with a read.
+		 * A lone read too large for the TX FIFO is still sent, as the
+		 * reply is read while the ZPU is writing it. */
+		cmdlen = replylen = 0;
+		last = -1;
+		for (j = i; j < nops; j++) {
+			n = ops[j].count ? 3 : 5;
+			if (j > i && (cmdlen + n > cmdmax ||
+			  replylen + ops[j].count * 2 > f->txfifo_sz - 1U))
+				break;
+			cmdlen += n;
+			replylen += ops[j].count * 2;
+			if (ops[j].count) last = j;
+		}
+
+		if (last < 0) {
+			n = zpu_muxbus_encode(&ops[i], cmd);
+			if (zpu_muxbus_cmd(f, cmd, n, NULL, 0, deadline))
+				return -1;
+			i++;
+			continue;
+		}
+
+		cmdlen = replylen = 0;
+		for (j = i; j <= last; j++) {
+			cmdlen += zpu_muxbus_encode(&ops[j], cmd + cmdlen);
+			replylen += ops[j].count * 2;
+		}
+		if (zpu_muxbus_cmd(f, cmd, cmdlen, reply, replylen, deadline))
+			return -1;
+
+		replylen = 0;
+		for (j = i; j <= last; j++) {
+			memcpy(ops[j].buf, reply + replylen, ops[j].count * 2);
+			replylen += ops[j].count * 2;
+		}
+		i = last + 1;
+	}
+
+	return 0;
+}
+
+/* MUXBUS 16bit peek with a deadline
+ *
+ * Returns 0 with the value in dat, or -1 with errno set to ETIMEDOUT if the
+ * ZPU did not reply by the deadline.
+ */
+int zpu_muxbus_peek16_until(struct zpu_fifo *f, uint16_t adr, uint16_t *dat,
+  const struct timespec *deadline)
+{
+	struct zpu_muxbus_op op;
+	uint8_t buf[2];
+
+	op.adr = adr;
+	op.dat = 0;
+	op.count = 1;
+	op.buf = buf;
+
+	if (zpu_muxbus_batch_until(f, &op, 1, deadline)) return -1;
+	*dat = (uint16_t)(((buf[0] << 8) & 0xFF00) + (buf[1] & 0xFF));
+
+	return 0;
+}
+
+/* MUXBUS 16bit poke with a deadline
+ *
+ * Returns 0 once the ZPU has written the register, or -1 with errno set to
+ * ETIMEDOUT if it did not complete by the deadline.
+ */
+int zpu_muxbus_poke16_until(struct zpu_fifo *f, uint16_t adr, uint16_t dat,
+  const struct timespec *deadline)
+{
+	struct zpu_muxbus_op op;
+
+	op.adr = adr;
+	op.dat = dat;
+	op.count = 0;
+	op.buf = NULL;
+
+	return zpu_muxbus_batch_until(f, &op, 1, deadline);
+}
+
+/* MUXBUS 16bit peek streaming with a deadline, count is in 16-bit words as
+ * for zpu_muxbus_peek16_stream().
+ *
+ * Returns the number of bytes read, or -1 with errno set to ETIMEDOUT if the
+ * ZPU did not return them all by the deadline.
+ */
+ssize_t zpu_muxbus_peek16_stream_until(struct zpu_fifo *f, uint16_t adr,
+  uint8_t *dat, ssize_t count, const struct timespec *deadline)
+{
+	struct zpu_muxbus_op op;
+
+	assert(dat != NULL);
+	/* Ensure that count never exceeds 64 */
+	assert(count > 0 && count <= 64);
+
+	op.adr = adr;
+	op.dat = 0;
+	op.count = count;
+	op.buf = dat;
+
+	if (zpu_muxbus_batch_until(f, &op, 1, deadline)) return -1;
+
+	return count * 2;
+}
+
 /* MUXBUS 16bit peek
  *
  * Internally handles the IRQ from the ZPU. Function only returns when data is
- * fully read back from the ZPU FIFO.
+ * fully read back from the ZPU FIFO, or after ZPU_MUXBUS_TIMEOUT_MS, when an
+ * error is printed and 0xFFFF is returned.
  */
-uint16_t zpu_muxbus_peek16(int twifd, uint16_t adr)
+uint16_t zpu_muxbus_peek16(struct zpu_fifo *f, uint16_t adr)
 {
-	char x = '?';
-	uint8_t buf[3];
-	fd_set efds;
-
-	buf[0] = (MB_READ | MB_16BIT);
-	buf[1] = (adr >> 8) & 0xFF;
-	buf[2] = (adr & 0xFF);
-
-	zpu_fifo_put(twifd, buf, 3);
-	FD_ZERO(&efds);
-	FD_SET(irqfd, &efds);
-	/* TODO: Check the return value, maybe set a timeout? */
-	select(irqfd + 1, NULL, NULL, &efds, NULL);
-	if (FD_ISSET(irqfd, &efds)) {
-		lseek(irqfd, 0, 0);
-		read(irqfd, &x, 1);
-		assert (x == '0' || x == '1');
+	struct timespec deadline;
+	uint16_t dat;
+
+	zpu_fifo_deadline(&deadline, ZPU_MUXBUS_TIMEOUT_MS);
+	if (zpu_muxbus_peek16_until(f, adr, &dat, &deadline)) {
+		perror("ZPU MUXBUS read failed");
+		return 0xFFFF;
 	}
-	zpu_fifo_get(twifd, buf, 2);
-	return (uint16_t)(((buf[0] << 8) & 0xFF00) + (buf[1] & 0xFF));
+
+	return dat;
 }
 
 /* MUXBUS 16bit poke
  *
  * Internally handles the IRQ from the ZPU. Function only returns when data is
- * successfully written to the MUXBUS register.
+ * successfully written to the MUXBUS register, or after
+ * ZPU_MUXBUS_TIMEOUT_MS, when an error is printed.
  */
-void zpu_muxbus_poke16(int twifd, uint16_t adr, uint16_t dat)
+void zpu_muxbus_poke16(struct zpu_fifo *f, uint16_t adr, uint16_t dat)
 {
-	char x = '?';
-	uint8_t buf[5];
-	fd_set efds;
+	struct timespec deadline;
 
-	buf[0] = (MB_WRITE | MB_16BIT);
-	buf[1] = (adr >> 8) & 0xFF;
-	buf[2] = (adr & 0xFF);
-	buf[3] = (dat >> 8) & 0xFF;
-	buf[4] = (dat & 0xFF);
-
-	zpu_fifo_put(twifd, buf, 5);
-	FD_ZERO(&efds);
-	FD_SET(irqfd, &efds);
-	/* TODO: Check the return value, maybe set a timeout? */
-	select(irqfd + 1, NULL, NULL, &efds, NULL);
-	if (FD_ISSET(irqfd, &efds)) {
-		lseek(irqfd, 0, 0);
-		read(irqfd, &x, 1);
-		assert (x == '0' || x == '1');
-	}
-	/* Read required to clear IRQ from ZPU side */
-	zpu_fifo_get(twifd, buf, 2);
+	zpu_fifo_deadline(&deadline, ZPU_MUXBUS_TIMEOUT_MS);
+	if (zpu_muxbus_poke16_until(f, adr, dat, &deadline))
+		perror("ZPU MUXBUS write failed");
 }
 
 /* MUXBUS 16bit peek streaming
@@ -386,36 +1778,19 @@ void zpu_muxbus_poke16(int twifd, uint16_t adr, uint16_t dat)
  * count.
  *
  * Internally handles the IRQ from the ZPU. Function only returns when data is
- * fully read back from the ZPU FIFO.
+ * fully read back from the ZPU FIFO, or after ZPU_MUXBUS_TIMEOUT_MS, when an
+ * error is printed.
  *
- * Returns the number of bytes read for a sanity check
+ * Returns the number of bytes read for a sanity check, -1 on timeout
  */
-ssize_t zpu_muxbus_peek16_stream(int twifd, uint16_t adr, uint8_t *dat, ssize_t count)
+ssize_t zpu_muxbus_peek16_stream(struct zpu_fifo *f, uint16_t adr, uint8_t *dat, ssize_t count)
 {
-	char x = '?';
-	uint8_t buf[3];
-	fd_set efds;
-	ssize_t bytes_read;
+	struct timespec deadline;
+	ssize_t ret;
 
-	/* dat is checked by zpu_fifo_get() so we don't need to worry */
-	/* Ensure that count never exceeds 64 */
-	assert(count <= 64);
-
-	buf[0] = (MB_READ | MB_16BIT | ((count - 1) << 2)) ;
-	buf[1] = (adr >> 8) & 0xFF;
-	buf[2] = (adr & 0xFF);
-
-	zpu_fifo_put(twifd, buf, 3);
-	FD_ZERO(&efds);
-	FD_SET(irqfd, &efds);
-	/* TODO: Check the return value, maybe set a timeout? */
-	select(irqfd + 1, NULL, NULL, &efds, NULL);
-	if (FD_ISSET(irqfd, &efds)) {
-		lseek(irqfd, 0, 0);
-		read(irqfd, &x, 1);
-		assert (x == '0' || x == '1');
-	}
-	bytes_read = zpu_fifo_get(twifd, dat, (count * 2));
+	zpu_fifo_deadline(&deadline, ZPU_MUXBUS_TIMEOUT_MS);
+	ret = zpu_muxbus_peek16_stream_until(f, adr, dat, count, &deadline);
+	if (ret < 0) perror("ZPU MUXBUS stream read failed");
 
-	return bytes_read;
+	return ret;
 }
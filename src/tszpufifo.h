@@ -1,18 +1,68 @@
 #ifndef __TSZPUFIFO_H__
 #define __TSZPUFIFO_H__
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct fpga_ctx;
+struct zpu_fifo;
+struct timespec;
+struct iovec;
+
 enum flowcontrol {
 	NO_FLOW_CTRL = 0,
 	FLOW_CTRL = 1,
 };
 
-void zpu_fifo_deinit(int twifd);
-int32_t zpu_fifo_init(int twifd, int flow_control);
-size_t zpu_fifo_get(int twifd, uint8_t *buf, size_t size);
-size_t zpu_fifo_put(int twifd, uint8_t *buf, size_t size);
+/* Called by zpu_fifo_get_cb() with each piece of data read, return nonzero to
+ * stop reading */
+typedef int (*zpu_fifo_cb)(void *arg, const uint8_t *data, size_t len);
+
+/* One MUXBUS access for zpu_muxbus_batch_until(). count is 0 for a 16-bit
+ * write of dat to adr, or the number of 16-bit words, 1 to 64, to read from
+ * adr in to buf, MSB first as zpu_muxbus_peek16_stream() stores them. */
+struct zpu_muxbus_op {
+	uint16_t adr;
+	uint16_t dat;
+	uint8_t count;
+	uint8_t *buf;
+};
+
+void zpu_fifo_deinit(struct zpu_fifo *f);
+struct zpu_fifo *zpu_fifo_init(struct fpga_ctx *fpga, int flow_control);
+struct zpu_fifo *zpu_broker_connect(const char *path);
+size_t zpu_fifo_get(struct zpu_fifo *f, uint8_t *buf, size_t size);
+size_t zpu_fifo_put(struct zpu_fifo *f, uint8_t *buf, size_t size);
+short zpu_fifo_irq_events(struct zpu_fifo *f);
+const char *zpu_fifo_irq_name(struct zpu_fifo *f);
+int zpu_fifo_irq_ack(struct zpu_fifo *f, struct timespec *ts);
+int zpu_fifo_irq_wait(struct zpu_fifo *f, struct timespec *ts);
+int zpu_fifo_fd(struct zpu_fifo *f);
+int zpu_fifo_set_coalesce(struct zpu_fifo *f, unsigned int bytes,
+  unsigned int timeout_us);
+void zpu_fifo_stats_print(struct zpu_fifo *f, FILE *out);
+void zpu_fifo_deadline(struct timespec *deadline, int timeout_ms);
+ssize_t zpu_fifo_get_nb(struct zpu_fifo *f, uint8_t *buf, size_t size);
+ssize_t zpu_fifo_put_nb(struct zpu_fifo *f, uint8_t *buf, size_t size);
+ssize_t zpu_fifo_get_until(struct zpu_fifo *f, uint8_t *buf, size_t size,
+  const struct timespec *deadline);
+ssize_t zpu_fifo_put_until(struct zpu_fifo *f, uint8_t *buf, size_t size,
+  const struct timespec *deadline);
+ssize_t zpu_fifo_readv(struct zpu_fifo *f, const struct iovec *iov, int iovcnt);
+ssize_t zpu_fifo_get_cb(struct zpu_fifo *f, size_t max, zpu_fifo_cb cb,
+  void *arg);
 
-uint16_t zpu_muxbus_peek16(int twifd, uint16_t adr);
-void zpu_muxbus_poke16(int twifd, uint16_t adr, uint16_t dat);
-ssize_t zpu_muxbus_peek16_stream(int twifd, uint16_t adr, uint8_t *dat, ssize_t count);
+uint16_t zpu_muxbus_peek16(struct zpu_fifo *f, uint16_t adr);
+void zpu_muxbus_poke16(struct zpu_fifo *f, uint16_t adr, uint16_t dat);
+ssize_t zpu_muxbus_peek16_stream(struct zpu_fifo *f, uint16_t adr, uint8_t *dat, ssize_t count);
+int zpu_muxbus_peek16_until(struct zpu_fifo *f, uint16_t adr, uint16_t *dat,
+  const struct timespec *deadline);
+int zpu_muxbus_poke16_until(struct zpu_fifo *f, uint16_t adr, uint16_t dat,
+  const struct timespec *deadline);
+ssize_t zpu_muxbus_peek16_stream_until(struct zpu_fifo *f, uint16_t adr,
+  uint8_t *dat, ssize_t count, const struct timespec *deadline);
+int zpu_muxbus_batch_until(struct zpu_fifo *f, struct zpu_muxbus_op *ops,
+  int nops, const struct timespec *deadline);
 
 #endif // __TSZPUFIFO_H__
@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <elf.h>
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tszputrace.h"
+
+/* These must match zpu/trace.h */
+#define ZPU_TRACE_BASE		0x10000
+#define ZPU_TRACE_MARK		0xff
+#define ZPU_TRACE_MAX_ARGS	8
+#define ZPU_TRACE_SECTION	".zputrace"
+
+/* Largest conversion spec rendered, e.g. "%-+#012.10x" */
+#define ZPU_TRACE_SPEC_MAX	32
+
+/* Decoder state, returned by zpu_trace_open() and passed to every other call.
+ * A record split across zpu_trace_write() calls is kept in rec until the rest
+ * of it arrives.
+ */
+struct zpu_trace {
+	/* Contents of the .zputrace section, and where it was linked */
+	char *fmts;
+	uint32_t fmts_sz, fmts_adr;
+	uint8_t rec[4 + (ZPU_TRACE_MAX_ARGS * 4)];
+	size_t reclen;
+};
+
+/* ELF header fields are in the byte order of the target, big endian for the
+ * ZPU, but either is handled.
+ * Not intended to be called directly
+ */
+static uint16_t elf16(int msb, uint16_t v)
+{
+	return msb ? be16toh(v) : le16toh(v);
+}
+
+static uint32_t elf32(int msb, uint32_t v)
+{
+	return msb ? be32toh(v) : le32toh(v);
+}
+
+/* Find the .zputrace section in the ELF image buf and copy it in to t.
+ *
+ * Returns 0 on success, or -1 with errno set to ENOEXEC if buf is not a 32 bit
+ * ELF or has no .zputrace section.
+ *
+ * Not intended to be called directly
+ */
+static int zpu_trace_load(struct zpu_trace *t, const uint8_t *buf, size_t sz)
+{
+	Elf32_Ehdr eh;
+	Elf32_Shdr sh, strsh;
+	uint32_t shoff, off, size, name;
+	uint16_t shentsize, shnum, shstrndx;
+	int msb, i;
+
+	if (sz < sizeof(eh)) goto bad;
+	memcpy(&eh, buf, sizeof(eh));
+	if (memcmp(eh.e_ident, ELFMAG, SELFMAG) ||
+	  eh.e_ident[EI_CLASS] != ELFCLASS32)
+		goto bad;
+	msb = (eh.e_ident[EI_DATA] == ELFDATA2MSB);
+
+	shoff = elf32(msb, eh.e_shoff);
+	shentsize = elf16(msb, eh.e_shentsize);
+	shnum = elf16(msb, eh.e_shnum);
+	shstrndx = elf16(msb, eh.e_shstrndx);
+	if (shentsize < sizeof(sh) || shstrndx >= shnum ||
+	  shoff > sz || (size_t)shnum * shentsize > sz - shoff)
+		goto bad;
+
+	memcpy(&strsh, buf + shoff + (shstrndx * shentsize), sizeof(strsh));
+	off = elf32(msb, strsh.sh_offset);
+	size = elf32(msb, strsh.sh_size);
+	if (off > sz || size > sz - off) goto bad;
+
+	for (i = 0; i < shnum; i++) {
+		memcpy(&sh, buf + shoff + (i * shentsize), sizeof(sh));
+		name = elf32(msb, sh.sh_name);
+		if (name >= size || size - name < sizeof(ZPU_TRACE_SECTION) ||
+		  memcmp(buf + off + name, ZPU_TRACE_SECTION,
+		  sizeof(ZPU_TRACE_SECTION)))
+			continue;
+
+		t->fmts_adr = elf32(msb, sh.sh_addr);
+		t->fmts_sz = elf32(msb, sh.sh_size);
+		if (elf32(msb, sh.sh_type) == SHT_NOBITS ||
+		  elf32(msb, sh.sh_offset) > sz ||
+		  t->fmts_sz > sz - elf32(msb, sh.sh_offset))
+			goto bad;
+
+		/* Terminated, so a bad id can't run off the end */
+		t->fmts = calloc(1, t->fmts_sz + 1);
+		if (t->fmts == NULL) return -1;
+		memcpy(t->fmts, buf + elf32(msb, sh.sh_offset), t->fmts_sz);
+		return 0;
+	}
+
+bad:
+	errno = ENOEXEC;
+	return -1;
+}
+
+/* Open the firmware ELF at path and read its format strings.
+ *
+ * Returns a decoder for zpu_trace_write(), or NULL with errno set.
+ *
+ * Can be called directly.
+ */
+struct zpu_trace *zpu_trace_open(const char *path)
+{
+	struct zpu_trace *t = NULL;
+	uint8_t *buf = NULL;
+	FILE *f;
+	long sz;
+	int err;
+
+	f = fopen(path, "rb");
+	if (f == NULL) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	sz = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (sz < 0) goto out;
+
+	buf = malloc(sz ? sz : 1);
+	t = calloc(1, sizeof(struct zpu_trace));
+	if (buf == NULL || t == NULL) goto out;
+	if (fread(buf, 1, sz, f) != (size_t)sz) {
+		errno = EIO;
+		goto out;
+	}
+
+	if (zpu_trace_load(t, buf, sz) == 0) {
+		free(buf);
+		fclose(f);
+		return t;
+	}
+
+out:
+	err = errno;
+	free(buf);
+	free(t);
+	fclose(f);
+	errno = err;
+	return NULL;
+}
+
+/* Can be called directly. */
+void zpu_trace_close(struct zpu_trace *t)
+{
+	if (t == NULL) return;
+	free(t->fmts);
+	free(t);
+}
+
+/* Render one complete record in t->rec to out. Conversions are done with the
+ * host printf(), with each argument as a 32 bit int. A conversion that is not
+ * supported, or has no argument left, is written as it is.
+ *
+ * Not intended to be called directly
+ */
+static void zpu_trace_render(struct zpu_trace *t, FILE *out)
+{
+	char spec[ZPU_TRACE_SPEC_MAX];
+	const char *fmt;
+	uint32_t args[ZPU_TRACE_MAX_ARGS];
+	uint32_t id, off;
+	int nargs, arg = 0, i, n;
+
+	nargs = t->rec[1];
+	id = (t->rec[2] << 8) | t->rec[3];
+	for (i = 0; i < nargs; i++) {
+		args[i] = (t->rec[4 + (i * 4)] << 24) |
+		  (t->rec[5 + (i * 4)] << 16) | (t->rec[6 + (i * 4)] << 8) |
+		  t->rec[7 + (i * 4)];
+	}
+
+	off = id + ZPU_TRACE_BASE - t->fmts_adr;
+	if (off >= t->fmts_sz) {
+		fprintf(out, "[trace 0x%04x?", id);
+		for (i = 0; i < nargs; i++) fprintf(out, " 0x%x", args[i]);
+		fprintf(out, "]");
+		return;
+	}
+
+	for (fmt = t->fmts + off; *fmt; fmt++) {
+		if (*fmt != '%') {
+			fputc(*fmt, out);
+			continue;
+		}
+		if (fmt[1] == '%') {
+			fputc('%', out);
+			fmt++;
+			continue;
+		}
+
+		/* Copy out flags, width and precision, dropping any length
+		 * modifier as every argument is 32 bits */
+		n = 0;
+		spec[n++] = *fmt++;
+		while (*fmt && strchr("-+ #0123456789.", *fmt) &&
+		  n < ZPU_TRACE_SPEC_MAX - 2)
+			spec[n++] = *fmt++;
+		while (*fmt && strchr("hljzt", *fmt)) fmt++;
+		if (*fmt == '\0') {
+			fwrite(spec, 1, n, out);
+			break;
+		}
+		spec[n++] = *fmt;
+		spec[n] = '\0';
+
+		if (!strchr("cdiuxXo", *fmt) || arg == nargs) {
+			fputs(spec, out);
+		} else if (*fmt == 'd' || *fmt == 'i') {
+			fprintf(out, spec, (int32_t)args[arg++]);
+		} else if (*fmt == 'c') {
+			fprintf(out, spec, (int)(uint8_t)args[arg++]);
+		} else {
+			fprintf(out, spec, (unsigned int)args[arg++]);
+		}
+	}
+}
+
+/* Write data read from the ZPU to out, with text passed through as it is and
+ * trace records rendered as text. A 0xff that does not start a valid record is
+ * passed through too.
+ *
+ * Can be called directly.
+ */
+void zpu_trace_write(struct zpu_trace *t, const uint8_t *data, size_t len,
+  FILE *out)
+{
+	const uint8_t *mark;
+	size_t n, need;
+
+	while (len) {
+		if (t->reclen == 0) {
+			mark = memchr(data, ZPU_TRACE_MARK, len);
+			n = mark ? (size_t)(mark - data) : len;
+			if (n) fwrite(data, 1, n, out);
+			data += n;
+			len -= n;
+			if (mark == NULL) break;
+		}
+
+		/* The mark and argument count, then the rest of the record */
+		need = (t->reclen < 2) ? 2 : 4 + (t->rec[1] * 4);
+		n = need - t->reclen;
+		if (n > len) n = len;
+		memcpy(t->rec + t->reclen, data, n);
+		t->reclen += n;
+		data += n;
+		len -= n;
+
+		if (t->reclen == 2 && t->rec[1] > ZPU_TRACE_MAX_ARGS) {
+			/* Not a record, the second byte may start one */
+			fputc(t->rec[0], out);
+			t->reclen = 0;
+			if (t->rec[1] == ZPU_TRACE_MARK) t->reclen = 1;
+			else fputc(t->rec[1], out);
+		} else if (t->reclen >= 2 && t->reclen == 4 + (t->rec[1] * 4)) {
+			zpu_trace_render(t, out);
+			t->reclen = 0;
+		}
+	}
+}
@@ -0,0 +1,17 @@
+#ifndef __TSZPUTRACE_H__
+#define __TSZPUTRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Decoder for the binary trace records of TRACE() in zpu/trace.h, which takes
+ * the format strings from the firmware ELF. */
+struct zpu_trace;
+
+struct zpu_trace *zpu_trace_open(const char *elf);
+void zpu_trace_close(struct zpu_trace *t);
+void zpu_trace_write(struct zpu_trace *t, const uint8_t *data, size_t len,
+  FILE *out);
+
+#endif // __TSZPUTRACE_H__
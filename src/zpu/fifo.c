@@ -23,9 +23,24 @@
  * unexpected ways. */
 
 
-/* Setup of FIFO sizes as well as the struct that contains the FIFO */
+/* Setup of FIFO sizes as well as the struct that contains the FIFO
+ *
+ * The sizes are passed to the CPU in the flags word, and may be overridden per
+ * application, e.g. FIFO_SIZES="-DZPU_RXFIFO_SIZE=256" on the make command line.
+ * Each may be up to 4095 bytes, but both buffers, the program, and its stack
+ * all share the 8 KiB of ZPU RAM.
+ */
+#ifndef ZPU_TXFIFO_SIZE
 #define ZPU_TXFIFO_SIZE		256
+#endif
+#ifndef ZPU_RXFIFO_SIZE
 #define ZPU_RXFIFO_SIZE		16
+#endif
+#if ZPU_TXFIFO_SIZE < 2 || ZPU_TXFIFO_SIZE > 4095 || \
+  ZPU_RXFIFO_SIZE < 2 || ZPU_RXFIFO_SIZE > 4095
+#error "ZPU FIFO sizes must be from 2 to 4095 bytes"
+#endif
+#define ZPU_TXFIFO_COALESCE_OPT	(1 << 24)
 #define ZPU_TXFIFO_NOFLOW_OPT	(1 << 25)
 #define ZPU_ATTENTION		(1 << 26)
 static struct zpu_fifo {
@@ -36,8 +51,120 @@ static struct zpu_fifo {
 	volatile unsigned long rxput;			// RX FIFO head
 	unsigned long rxget;				// RX FIFO tail
 	volatile unsigned char rxdat[ZPU_RXFIFO_SIZE];  // RX buffer
+	volatile unsigned long coalesce;		// TX IRQ coalescing
 } fifo;
 
+/* FIFO cursors
+ *
+ * The heads and tails are positions in to the buffers. FIFOs larger than 256
+ * bytes need 16 bit positions, which the CPU reads and writes over I2C a byte
+ * at a time. So that neither side acts on a half updated position, the upper
+ * byte is repeated in bits 23:16 of the word. The CPU writes that copy last,
+ * a position from the CPU where the two copies differ is still being updated
+ * and the last good one is used instead. Positions written here are written
+ * as a whole word, with the copy, by fifo_cursor().
+ */
+#define fifo_cursor(pos)	((pos) | (((pos) & 0xff00) << 8))
+
+/* Last good TX FIFO tail and RX FIFO head written by the CPU */
+static unsigned long txget_last, rxput_last;
+
+/* Current TX FIFO tail, as written by the CPU
+ * Not intended to be called directly
+ */
+static unsigned long fifo_txget(void)
+{
+	unsigned long get = fifo.txget;
+
+	if (((get >> 16) & 0xff) == ((get >> 8) & 0xff))
+		txget_last = get & 0xffff;
+
+	return txget_last;
+}
+
+/* Current RX FIFO head, as written by the CPU
+ * Not intended to be called directly
+ */
+static unsigned long fifo_rxput(void)
+{
+	unsigned long put = fifo.rxput;
+
+	if (((put >> 16) & 0xff) == ((put >> 8) & 0xff))
+		rxput_last = put & 0xffff;
+
+	return rxput_last;
+}
+
+/* TX IRQ coalescing
+ *
+ * By default every putc(), puts() and fifo_write() raises IRQ0. The CPU may
+ * instead write a watermark in bytes to the low 16 bits of fifo.coalesce, and
+ * a timeout to the high 16 bits in units of 1024 TIMER_REG ticks, about 16 us.
+ * IRQ0 is then only raised once the TX FIFO holds at least the watermark, or
+ * the oldest byte put since the last IRQ has waited for the timeout. Either
+ * may be 0 to leave it out. ZPU_TXFIFO_COALESCE_OPT in the flags tells the CPU
+ * this firmware supports it.
+ *
+ * The timeout is checked as data is put, and by getc(), fifo_avail() and
+ * fifo_poll(), so firmware that idles for long in other loops should call
+ * fifo_poll() from them. A full TX FIFO and fifo_raise_irq0() always raise
+ * IRQ0 straight away.
+ */
+
+/* Set when bytes have been put without an IRQ, with the TIMER_REG then */
+static unsigned long irq_pending, irq_since;
+
+/* Raise IRQ0 on the TX FIFO head
+ * Not intended to be called directly
+ */
+static void fifo_irq(void)
+{
+	irq_pending = 0;
+	IRQ0_REG = (unsigned long)(&fifo.txput) + 3;
+}
+
+/* Raise IRQ0 if a coalesced IRQ has waited for the timeout
+ * Can be called directly
+ */
+void fifo_poll(void)
+{
+	unsigned long timeout = fifo.coalesce >> 16;
+
+	if (irq_pending && timeout &&
+	  ((TIMER_REG - irq_since) >> 10) >= timeout)
+		fifo_irq();
+}
+
+/* Raise IRQ0 after data is put in the TX FIFO, or hold it back as the CPU set
+ * with fifo.coalesce
+ * Not intended to be called directly
+ */
+static void fifo_tx_irq(void)
+{
+	unsigned long coalesce = fifo.coalesce;
+	unsigned long watermark = coalesce & 0xffff;
+	unsigned long put, get, waiting;
+
+	if (coalesce == 0) {
+		fifo_irq();
+		return;
+	}
+
+	put = fifo.txput & 0xffff;
+	get = fifo_txget();
+	waiting = put >= get ? put - get : sizeof(fifo.txdat) - get + put;
+	if (watermark && waiting >= watermark) {
+		fifo_irq();
+		return;
+	}
+
+	if (!irq_pending) {
+		irq_pending = 1;
+		irq_since = TIMER_REG;
+	}
+	fifo_poll();
+}
+
 /* Place a single byte in to the TX FIFO
  *
  * This will not raise an IRQ when a byte is placed in the FIFO normally.
@@ -57,7 +184,7 @@ static struct zpu_fifo {
  */
 void putc_noirq(char c)
 {
-	unsigned long put = fifo.txput;
+	unsigned long put = fifo.txput & 0xffff;
 
 	fifo.txdat[put++] = c;
 	if (put == sizeof(fifo.txdat)) put = 0;
@@ -67,30 +194,31 @@ void putc_noirq(char c)
 	 * to just behind the tail, assert the IRQ, and spin until the tail is
 	 * moved (data read by CPU) or flow control is disabled by the CPU.
 	 */
-	if (put == fifo.txget &&
+	if (put == fifo_txget() &&
 	  (fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0) {
-		fifo.txput = (put - 1);
+		fifo.txput = fifo_cursor(put ? put - 1 :
+		  sizeof(fifo.txdat) - 1);
 
 		/* Raise IRQ if there is no space left in the buffer. While an IRQ
 		 * likely has already been raised with a series of putc() calls,
 		 * do it again to ensure that the CPU is aware that the firmware
 		 * is now busylooping. */
-		//fifo_raise_irq0()
-		IRQ0_REG = (unsigned long)(&fifo.txput) + 3;
+		fifo_irq();
 
 		/* Pause until FIFO not full or flow control disabled */
-		while (put == fifo.txget &&
+		while (put == fifo_txget() &&
 		  (fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0);
 	}
 
-	fifo.txput = put;
+	fifo.txput = fifo_cursor(put);
 }
 
 /* Put a byte in to the TX FIFO and raise an IRQ to the CPU. Calls putc_noirq()
  * for the heavy lifting.
  *
  * An IRQ is raised to the CPU with the address of the TX FIFO head. Once the CPU
- * reads from that address, the IRQ is automatically cleared by the FPGA.
+ * reads from that address, the IRQ is automatically cleared by the FPGA. If the
+ * CPU has set up IRQ coalescing, the IRQ may instead be held back, see above.
  *
  * This function may stall and issue an IRQ if the FIFO is full when attempting
  * to place the byte in to it.
@@ -98,7 +226,7 @@ void putc_noirq(char c)
 void putc(char c)
 {
 	putc_noirq(c);
-	IRQ0_REG = (unsigned long)(&fifo.txput) + 3; //fifo_raise_irq0()
+	fifo_tx_irq();
 }
 
 /* Place a null terminated string in to the TX FIFO.
@@ -123,7 +251,7 @@ void putc(char c)
  */
 int puts(const char *s)
 {
-	unsigned long put = fifo.txput;
+	unsigned long put = fifo.txput & 0xffff;
 	unsigned char c;
 
 	while ((c = *(s++)) != 0) {
@@ -139,27 +267,88 @@ int puts(const char *s)
 		 * This can happen if the string is bigger than the FIFO or if
 		 * there is already data waiting in the FIFO.
 		 */
-		if (put == fifo.txget &&
+		if (put == fifo_txget() &&
 		  (fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0) {
-			fifo.txput = (put - 1);
+			fifo.txput = fifo_cursor(put ? put - 1 :
+			  sizeof(fifo.txdat) - 1);
 
 			/* Raise IRQ in case the string to write is longer than
 			 * the buffer and an IRQ is otherwise unraised */
-			//fifo_raise_irq0()
-			IRQ0_REG = (unsigned long)(&fifo.txput) + 3;
+			fifo_irq();
 
 			/* Pause until FIFO not full or flow control disabled */
-			while (put == fifo.txget &&
+			while (put == fifo_txget() &&
 			  (fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0);
 		}
 	}
 
-	fifo.txput = put;
-	IRQ0_REG = (unsigned long)(&fifo.txput) + 3; //fifo_raise_irq0()
+	fifo.txput = fifo_cursor(put);
+	fifo_tx_irq();
 
 	return 0;
 }
 
+/* Free space in the TX FIFO for a head at put
+ * Not intended to be called directly
+ */
+static unsigned long fifo_txspace(unsigned long put)
+{
+	unsigned long get = fifo_txget();
+
+	if (get > put) return get - put - 1;
+	return sizeof(fifo.txdat) - put + get - 1;
+}
+
+/* Place len bytes from buf in to the TX FIFO and raise an IRQ once they are
+ * all there.
+ *
+ * Unlike a series of putc_noirq() calls, the bytes are copied in with at most
+ * two memcpy() calls, split where the ring wraps, and the head is written
+ * back once, so the CPU sees the whole block at once.
+ *
+ * If flow control is enabled and the block does not fit, as much as fits is
+ * placed, the head is written back and an IRQ raised to get the CPU's
+ * attention, and this busywaits for more space, as putc_noirq() does. Without
+ * flow control, the block is placed regardless, overrunning unread data.
+ *
+ * Can be called directly
+ */
+void fifo_write(const void *buf, unsigned long len)
+{
+	const unsigned char *p = buf;
+	unsigned long put = fifo.txput & 0xffff;
+	unsigned long n;
+
+	while (len) {
+		if ((fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0) {
+			n = fifo_txspace(put);
+			if (n == 0) {
+				fifo.txput = fifo_cursor(put);
+				fifo_irq();
+
+				/* Pause until FIFO not full or flow control
+				 * disabled */
+				while (fifo_txspace(put) == 0 &&
+				  (fifo.flags & ZPU_TXFIFO_NOFLOW_OPT) == 0);
+				continue;
+			}
+			if (n > len) n = len;
+		} else {
+			n = len;
+		}
+		if (n > sizeof(fifo.txdat) - put) n = sizeof(fifo.txdat) - put;
+
+		memcpy(&fifo.txdat[put], p, n);
+		p += n;
+		len -= n;
+		put += n;
+		if (put == sizeof(fifo.txdat)) put = 0;
+	}
+
+	fifo.txput = fifo_cursor(put);
+	fifo_tx_irq();
+}
+
 /* Receive a single byte from the RX FIFO.
  * This is simply polled from from the main program flow.
  * Can be called directly
@@ -167,17 +356,65 @@ int puts(const char *s)
 signed long getc(void)
 {
 	signed long r;
-	unsigned long rxget = fifo.rxget;
-	if (rxget != fifo.rxput) {
+	unsigned long rxget = fifo.rxget & 0xffff;
+
+	fifo_poll();
+	if (rxget != fifo_rxput()) {
 		r = fifo.rxdat[rxget++];
 		if (rxget == sizeof(fifo.rxdat)) rxget = 0;
-		fifo.rxget = rxget;
+		fifo.rxget = fifo_cursor(rxget);
 		return r;
 	} else {
 		return -1;
 	}
 }
 
+/* Number of bytes waiting in the RX FIFO.
+ * Firmware can wait for this to reach the length of a whole packet and then
+ * read it with one fifo_read(), rather than polling getc() for each byte.
+ * Can be called directly
+ */
+unsigned long fifo_avail(void)
+{
+	unsigned long rxget = fifo.rxget & 0xffff;
+	unsigned long put = fifo_rxput();
+
+	fifo_poll();
+	if (put >= rxget) return put - rxget;
+	return sizeof(fifo.rxdat) - rxget + put;
+}
+
+/* Receive up to len bytes from the RX FIFO in to buf, without waiting.
+ *
+ * The bytes are copied out with at most two memcpy() calls, split where the
+ * ring wraps, and the tail is written back once.
+ *
+ * Returns the number of bytes read, 0 if the RX FIFO is empty.
+ *
+ * Can be called directly
+ */
+unsigned long fifo_read(void *buf, unsigned long len)
+{
+	unsigned char *p = buf;
+	unsigned long rxget = fifo.rxget & 0xffff;
+	unsigned long avail = fifo_avail();
+	unsigned long n;
+
+	if (len > avail) len = avail;
+	if (len == 0) return 0;
+
+	n = sizeof(fifo.rxdat) - rxget;
+	if (n > len) n = len;
+	memcpy(p, (unsigned char *)&fifo.rxdat[rxget], n);
+	if (len > n) memcpy(p + n, (unsigned char *)fifo.rxdat, len - n);
+
+	rxget += len;
+	if (rxget >= sizeof(fifo.rxdat)) rxget -= sizeof(fifo.rxdat);
+	fifo.rxget = fifo_cursor(rxget);
+
+	return len;
+}
+
 /* Initialize the FIFO link so the CPU knows where it is and how to access it.
  * This needs to be called early in the main() function, before any FIFO actions
  * take place.
@@ -191,9 +428,12 @@ signed long getc(void)
  */
 void fifo_init(void)
 {
-	*(unsigned long *)0x3c = (unsigned long)(&fifo);
+	fifo.coalesce = 0;
 	fifo.flags = sizeof(fifo.txdat) | sizeof(fifo.rxdat) << 12 |
-	  ZPU_TXFIFO_NOFLOW_OPT;
+	  ZPU_TXFIFO_COALESCE_OPT | ZPU_TXFIFO_NOFLOW_OPT;
+	/* Published last, the host takes a nonzero pointer as the FIFO being
+	 * ready */
+	*(volatile unsigned long *)0x3c = (unsigned long)(&fifo);
 }
 
 /* Raise IRQ0 on the last TX FIFO address
@@ -201,7 +441,7 @@ void fifo_init(void)
  */
 void fifo_raise_irq0(void)
 {
-	IRQ0_REG = (unsigned long)(&fifo.txput) + 3;
+	fifo_irq();
 }
 
 /* This ends the TS created FIFO code. */
@@ -24,12 +24,31 @@ void putc_noirq(char c);
  */
 int puts(const char *s);
 
+/*
+ * Place len bytes from buf in the ZPU TX FIFO and raise a single IRQ after.
+ * The TX FIFO head is only updated once the whole block is in place, unless
+ * flow control is enabled and the block does not fit, when this function will
+ * update the head and stall (after asserting an IRQ) until there is space.
+ */
+void fifo_write(const void *buf, unsigned long len);
+
 /*
  * Get a single byte from the RX FIFO.
  * Returns byte value if data was available, returns -1 if no new byte in RX FIFO
  */
 signed long getc(void);
 
+/*
+ * Number of bytes waiting in the RX FIFO.
+ */
+unsigned long fifo_avail(void);
+
+/*
+ * Get up to len bytes from the RX FIFO in to buf, in one pass.
+ * Returns the number of bytes read, 0 if no data was waiting in the RX FIFO
+ */
+unsigned long fifo_read(void *buf, unsigned long len);
+
 /*
  * Initialize the ZPU FIFO link.
  * This places a pointer to the FIFO structure at a known address in memory that
@@ -44,4 +63,11 @@ void fifo_init(void);
  */
 void fifo_raise_irq0(void);
 
+/*
+ * Raise a coalesced TX FIFO IRQ that has waited for its timeout, see "TX IRQ
+ * coalescing" in fifo.c. getc() and fifo_avail() do this too, firmware that
+ * waits for long without calling either should call this as it waits.
+ */
+void fifo_poll(void);
+
 #endif // __FIFO_H__
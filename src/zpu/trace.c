@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <string.h>
+
+#include "fifo.h"
+#include "trace.h"
+
+/* Build a trace record, see trace.h, and put it in the TX FIFO in one go. Any
+ * arguments past ZPU_TRACE_MAX_ARGS are dropped.
+ * Can be called directly
+ */
+void trace_put(unsigned long fmt, unsigned long nargs,
+  const unsigned long *args)
+{
+	unsigned char rec[4 + (ZPU_TRACE_MAX_ARGS * 4)];
+
+	if (nargs > ZPU_TRACE_MAX_ARGS) nargs = ZPU_TRACE_MAX_ARGS;
+	fmt -= ZPU_TRACE_BASE;
+
+	rec[0] = ZPU_TRACE_MARK;
+	rec[1] = nargs;
+	rec[2] = fmt >> 8;
+	rec[3] = fmt;
+	/* The ZPU is big endian, the arguments are already in record order */
+	memcpy(rec + 4, args, nargs * 4);
+
+	fifo_write(rec, 4 + (nargs * 4));
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Binary trace records
+ *
+ * TRACE() is a stand in for printf() that does no formatting in the ZPU. The
+ * format string is placed in the .zputrace section, which the Makefile links
+ * at ZPU_TRACE_BASE, well outside of ZPU RAM, and strips from the .bin, so
+ * format strings take up no ZPU RAM at all. Only a record is put in the TX
+ * FIFO:
+ *
+ *   0xff, nargs, id[15:8], id[7:0], nargs * 32 bit big endian arguments
+ *
+ * where id is the offset of the format string in .zputrace. The host renders
+ * the record with the format string from the firmware ELF, with
+ * "tszpuctl --connect --trace <firmware.elf>".
+ *
+ * Arguments are any integer type, up to ZPU_TRACE_MAX_ARGS of them, and are
+ * sent as 32 bits each. The format may use the %c, %d, %i, %u, %x, %X and %o
+ * conversions with the usual flags, width and precision, but not %s as the
+ * host has no access to ZPU RAM. Text from putc() and puts() may be mixed with
+ * records, as long as it never contains a 0xff byte.
+ */
+#define ZPU_TRACE_BASE		0x10000
+#define ZPU_TRACE_MARK		0xff
+#define ZPU_TRACE_MAX_ARGS	8
+
+#define TRACE(fmt, ...) \
+	do { \
+		static const char _trace_fmt[] \
+		  __attribute__((section(".zputrace"))) = fmt; \
+		unsigned long _trace_args[] = { 0, ##__VA_ARGS__ }; \
+		trace_put((unsigned long)_trace_fmt, \
+		  sizeof(_trace_args) / sizeof(_trace_args[0]) - 1, \
+		  _trace_args + 1); \
+	} while (0)
+
+/*
+ * Put one trace record in the TX FIFO and raise a single IRQ after, as
+ * fifo_write(). Normally only called through TRACE().
+ */
+void trace_put(unsigned long fmt, unsigned long nargs,
+  const unsigned long *args);
+
+#endif // __TRACE_H__
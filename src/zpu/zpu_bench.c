@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "ts_zpu.h"
+#include "fifo.h"
+
+
+/* ZPU FIFO benchmark application.
+ *
+ * This is the ZPU side of tszpubench. It waits for single byte commands from
+ * the RX FIFO, each followed by a length, and answers through the TX FIFO:
+ *
+ * 'E' <n>            Echo the next n bytes back (n of 0 means 256), with an
+ *                      IRQ once the last byte is in the TX FIFO.
+ * 'S' <n3 n2 n1 n0>  Sink, read and discard the next n bytes (32-bit, MSB
+ *                      first), then put 'S' in the TX FIFO with an IRQ.
+ * 'O' <n3 n2 n1 n0>  Source, put n bytes in the TX FIFO, byte i being i & 0xff,
+ *                      with an IRQ after the last.
+ *
+ * Any other command byte is ignored. With flow control, a full TX FIFO also
+ * raises an IRQ, see putc_noirq().
+ *
+ * The simulated FPGA has a native copy of this application, see fpga_sim.c,
+ * which must be kept in step with any change here.
+ */
+
+/* Wait for a byte from the RX FIFO */
+static unsigned char getc_wait(void)
+{
+	signed long c;
+
+	while ((c = getc()) == -1);
+
+	return c;
+}
+
+/* Get the 32-bit count following an 'S' or 'O' command */
+static unsigned long get_count(void)
+{
+	unsigned long n = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) n = (n << 8) | getc_wait();
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long i, n;
+
+	fifo_init();
+
+	while (1) {
+		switch (getc_wait()) {
+		  case 'E':
+			n = getc_wait();
+			if (n == 0) n = 256;
+			for (i = 1; i < n; i++) putc_noirq(getc_wait());
+			putc(getc_wait());
+			break;
+		  case 'S':
+			n = get_count();
+			for (i = 0; i < n; i++) getc_wait();
+			putc('S');
+			break;
+		  case 'O':
+			n = get_count();
+			if (n == 0) break;
+			for (i = 0; i < n - 1; i++) putc_noirq(i & 0xff);
+			putc(i & 0xff);
+			break;
+		  default:
+			break;
+		}
+	}
+
+	return 0;
+}
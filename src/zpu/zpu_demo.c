@@ -5,7 +5,7 @@
 
 #include "ts_zpu.h"
 #include "fifo.h"
-#include "strings.h"
+#include "trace.h"
 
 
 /* ZPU Demo application.
@@ -16,7 +16,9 @@
  * - Echo all characters received, and toggle the red and green LEDs with every
  *     character as they are received from the FIFO.
  * - If a newline is received, the application will then print the time since
- *     the last newline was received in number of 63 MHz clocks.
+ *     the last newline was received in number of 63 MHz clocks. This is sent
+ *     as a trace record, so connect with
+ *     "tszpuctl --connect --trace zpu_demo.elf" to see it as text.
  */
 int main(int argc, char **argv)
 {
@@ -29,7 +31,7 @@ int main(int argc, char **argv)
 		while ((c = getc()) == -1);
 		O_REG0 ^= 0x18000000;
 		d2 = TIMER_REG;
-		if (c == '\r') printf(" %d\r\n", d2 - d);
+		if (c == '\r') TRACE(" %d\r\n", d2 - d);
 		else putc(c);
 		d = d2;
 	}
@@ -7,14 +7,16 @@
 #include "fifo.h"
 #include "ts_zpu.h"
 
-/* State machine defines for operation loop */
-#define	GET_CMD		0
-#define	GET_ADRH	1
-#define	GET_ADRL	2
-#define	GET_DATH	3
-#define	GET_DATL	4
-#define	RET_WRITE	5
-#define	RET_READ	6
+/* Command packet, the command byte is followed by the address and, for a
+ * write, the data, each MSB first */
+#define CMD_READ_LEN	3
+#define CMD_WRITE_LEN	5
+
+/* The command byte is read first, the rest of a write must then fit in the
+ * RX FIFO at once. The sizes are only known here if overridden, see fifo.c */
+#if defined(ZPU_RXFIFO_SIZE) && ZPU_RXFIFO_SIZE < CMD_WRITE_LEN
+#error "zpu_muxbus needs an RX FIFO of at least 5 bytes"
+#endif
 
 /* ZPU MUXBUS application.
  *
@@ -23,63 +25,50 @@
  * The return value for a read is 2 bytes, while a write only notifies the CPU
  * upon completion. IRQs are not asserted from the ZPU until a whole 16-bit word
  * is available from the MUXBUS transaction.
+ *
+ * Each packet is taken from the RX FIFO whole, once the command byte says how
+ * long it is and that many bytes have arrived, rather than a byte at a time.
  */
 int main(int argc, char **argv)
 {
-	unsigned char state = 0, rwn, width;
+	unsigned char rwn;
 	unsigned short adr, dat;
-	signed long buf;
-	unsigned char readcnt;
+	unsigned char cmd[CMD_WRITE_LEN];
+	unsigned char len, readcnt;
+	/* Words read for the current command, up to 64, returned together */
+	unsigned char out[128];
+	unsigned char outlen;
 
 	fifo_init();
 	initmuxbusio();
 
 	while(1) {
-		/* Every loop of this state machine, query to see if there is new
-		 * data in the RX FIFO. This only happens through the GET_DATL
-		 * state, any states beyond GET_CMD, GET_ADRH, GET_ADRL, GET_DATH,
-		 * and GET_DATL will no longer be expecting RX FIFO data */
-		if (state < RET_WRITE) {
-			while ((buf = getc()) == -1);
-		}
+		/* Wait for the command byte, then the rest of the packet */
+		while (fifo_avail() == 0);
+		fifo_read(cmd, 1);
+		rwn = cmd[0] & 0x1;
+		len = (rwn == READ) ? CMD_READ_LEN : CMD_WRITE_LEN;
+		while (fifo_avail() < len - 1);
+		fifo_read(cmd + 1, len - 1);
+
+		adr = (cmd[1] << 8) + cmd[2];
+		readcnt = ((cmd[0] & 0xFC) >> 2) + 1;
 
-		switch(state) {
-		  /* Get command byte, first byte */
-		  case GET_CMD:
-			rwn = buf & 0x1;
-			set_dir(rwn);
-			width = (buf & 0x2) >> 1;
-			state = GET_ADRH;
-			adr = 0;
-			dat = 0;
-			readcnt = ((buf & 0xFC) >> 2) + 1;
-			break;
-		  /* Get address high and low bytes, high byte first */
-		  case GET_ADRH:
-		  case GET_ADRL:
-			adr = (adr << 8) + (buf & 0xFF);
-			state++;
-			if (state == GET_DATH) {
-				set_ad(adr);
-				set_ad_oe(1);
-				set_alen(0);
-				delay_clks(TP_ALE);
-				set_alen(1);
-				delay_clks(TH_ADR);
-				if (rwn == READ) state = RET_READ;
-			}
-			break;
-		  /* In the case of a write, get H/L bytes of data to write to the
-		   * MUXBUS. High byte first. */
-		  case GET_DATH:
-		  case GET_DATL:
-			dat = (dat << 8) + (buf & 0xFF);
-			state++;
-			break;
-		  /* Do the actual write of data to MUXBUS register. While this
-		   * does not return any data, an IRQ is still asserted to let the
-		   * CPU know that the operation is complete */
-		  case RET_WRITE:
+		/* Address phase */
+		set_dir(rwn);
+		set_ad(adr);
+		set_ad_oe(1);
+		set_alen(0);
+		delay_clks(TP_ALE);
+		set_alen(1);
+		delay_clks(TH_ADR);
+
+		if (rwn != READ) {
+			/* Do the actual write of data to MUXBUS register. While
+			 * this does not return any data, an IRQ is still
+			 * asserted to let the CPU know that the operation is
+			 * complete */
+			dat = (cmd[3] << 8) + cmd[4];
 			set_ad(dat);
 			delay_clks(TSU_DAT);
 			set_csn(0);
@@ -87,44 +76,32 @@ int main(int argc, char **argv)
 			set_csn(1);
 			delay_clks(TH_DAT);
 			/* Used to indicate to the CPU that data was written to
-			 * MUXBUS. Dummy read of the FIFO is required from the CPU
-			 * side. */
+			 * MUXBUS. Dummy read of the FIFO is required from the
+			 * CPU side. */
 			fifo_raise_irq0();
-			state = GET_CMD;
-			break;
-		  /* Do the actual read. The CPU is expecting a full 16-bit qty
-		   * to be returned in a single read, therefore, do not assert IRQ
-		   * after the first byte, only the second byte. */
-		  case RET_READ:
-			readcnt--;
-			set_ad_oe(0);
+			continue;
+		}
+
+		/* Do the actual reads, readcnt words from the one address.
+		 * Collect both bytes of each, MSB first, and write the whole
+		 * stream to the FIFO after the last word with a single IRQ.
+		 * The CPU side is expecting to read a full two bytes in a
+		 * single FIFO readout, and a single block costs one head
+		 * update rather than one per byte.
+		 */
+		set_ad_oe(0);
+		for (outlen = 0; readcnt; readcnt--) {
 			delay_clks(TSU_DAT);
 			set_csn(0);
 			delay_clks(TP_CS);
 			dat = get_ad();
 			set_csn(1);
 			delay_clks(TH_DAT);
-			/* Write both bytes to the FIFO, MSB first. Do not raise
-			 * an IRQ until we're writing the absolute last byte
-			 * of a stream of bytes.
-			 * The CPU side is expecting to read a full two bytes in
-			 * a single FIFO readout. It will also be more efficient
-			 * since this can be done in a single I2C transaction.
-			 */
-			putc_noirq((dat >> 8) & 0xFF);
-			if (!readcnt) {
-				putc(dat & 0xFF);
-				state = GET_CMD;
-			} else {
-				putc_noirq(dat & 0xFF);
-			}
-			break;
-		  default:
-			state = GET_CMD;
-			break;
+			out[outlen++] = (dat >> 8) & 0xFF;
+			out[outlen++] = dat & 0xFF;
 		}
+		fifo_write(out, outlen);
 	}
 
 	return 0;
 }
-
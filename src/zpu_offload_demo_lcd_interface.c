@@ -55,6 +55,9 @@ int get_model()
 	char mdl[256];
 	char *ptr;
 
+	/* The simulated FPGA stands in for a TS-4100 */
+	if (fpga_simulated()) return 0x4100;
+
 	proc = fopen("/proc/device-tree/model", "r");
 	if (!proc) {
 		perror("model");
@@ -228,14 +231,12 @@ void lcd_demo_info_loop(int lcdfd)
 
 
 int main(int argc, char **argv) {
-	int twifd;
+	struct fpga_ctx *fpga;
 	uint8_t fifobuf[9]; // At most we expect 8 bytes
 	int16_t temp;
 	char lcdbuf[4][21] = {0};
-	int irqfd;
+	struct zpu_fifo *zf;
 	int lcdfd = 0;
-	char x = '?';
-	fd_set efds;
 	int i;
 
 	if(get_model() != 0x4100) {
@@ -243,8 +244,8 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	twifd = fpga_init("/dev/i2c-2", 0x28);
-	if(twifd == -1) {
+	fpga = fpga_init("/dev/i2c-2", 0x28);
+	if(fpga == NULL) {
 		/* fpga_init() calls open() which fails with errno set */
 		perror("Can't open FPGA I2C bus");
 		return 1;
@@ -256,8 +257,8 @@ int main(int argc, char **argv) {
 	 * This application cares about the IRQ from the ZPU as that is the
 	 * signal that the whole packet we expect has been written to the FIFO.
 	 */
-	irqfd = zpu_fifo_init(twifd, FLOW_CTRL);
-	if (irqfd < 0) {
+	zf = zpu_fifo_init(fpga, FLOW_CTRL);
+	if (zf == NULL) {
 		goto out;
 	}
 
@@ -283,20 +284,13 @@ int main(int argc, char **argv) {
 
 		/* Write a byte to trigger data out */
 		fifobuf[0] = '\r';
-		zpu_fifo_put(twifd, fifobuf, 1);
+		zpu_fifo_put(zf, fifobuf, 1);
 
 		/* Wait for IRQ from ZPU to denote the packet is complete and
 		 * ready to consume.
 		 */
-		FD_ZERO(&efds);
-		FD_SET(irqfd, &efds);
-		select(irqfd + 1, NULL, NULL, &efds, NULL);
-		if (FD_ISSET(irqfd, &efds)) {
-			lseek(irqfd, 0, 0);
-			read(irqfd, &x, 1);
-			assert (x == '0' || x == '1');
-		}
-		zpu_fifo_get(twifd, fifobuf, sizeof(fifobuf));
+		zpu_fifo_irq_wait(zf, NULL);
+		zpu_fifo_get(zf, fifobuf, sizeof(fifobuf));
 
 		/* Update buffers to write to the LCD screen */
 		if (fifobuf[0]) {
@@ -335,10 +329,10 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	zpu_fifo_deinit(twifd);
+	zpu_fifo_deinit(zf);
 
 out:
-	fpga_deinit(twifd);
+	fpga_deinit(fpga);
 
 	return 1;
 }